@@ -0,0 +1,176 @@
+/* See LICENSE for license details. */
+/*
+ * st-bench replays recorded tty output through the terminal emulation,
+ * with a window that draws nothing, and reports how fast it went.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+char *argv0;
+#include "arg.h"
+#include "st.h"
+#include "win.h"
+
+/* the settings st.c and boxdraw.c use, as st is built with them */
+#include "termconfig.h"
+
+#define NSEC(t)			((t).tv_sec * 1E9 + (t).tv_nsec)
+
+static void usage(void);
+
+static int cols = 80;
+static int rows = 24;
+static size_t framesiz = 1 << 16; /* bytes between draw() calls, >= 4 */
+static int count = 1;
+static Glyph *glyphbuf;
+
+/* a window that takes everything and shows nothing */
+void xbell(void) {}
+void xclipcopy(void) {}
+void xdrawcursor(int cx, int cy, Glyph g) {}
+void xfinishdraw(void) {}
+void xscroll(int top, int bot, int n) {}
+void xloadcols(void) {}
+int xsetcolorname(int x, const char *name) { return 0; }
+int xgetcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+	*r = *g = *b = 0;
+	return 0;
+}
+void xseticontitle(char *p) {}
+void xsettitle(char *p) {}
+int xsetcursor(int cursor) { return 0; }
+void xsetmode(int set, unsigned int flags) {}
+void xsetpointermotion(int set) {}
+void xsetsel(char *str) { free(str); }
+int xstartdraw(void) { return 1; }
+void xximspot(int x, int y) {}
+
+/* lines are unpacked as x.c does, Xft is left out */
+void
+xdrawline(Line line, int x1, int y1, int x2)
+{
+	tglyphs(line, x1, x2, glyphbuf);
+}
+
+static char *
+readfile(const char *path, size_t *len)
+{
+	char *buf = NULL;
+	size_t siz = 0;
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("open %s failed: %s\n", path, strerror(errno));
+	for (*len = 0;; *len += r) {
+		if (*len == siz)
+			buf = xrealloc(buf, siz = siz ? siz * 2 : BUFSIZ);
+		if ((r = read(fd, buf + *len, siz - *len)) < 0)
+			die("read %s failed: %s\n", path, strerror(errno));
+		if (r == 0)
+			break;
+	}
+	close(fd);
+
+	return buf;
+}
+
+static void
+bench(FILE *out, const char *path)
+{
+	struct timespec t0, t1, t2;
+	double parse = 0, render = 0;
+	size_t len, n, k, total = 0;
+	int i, frames = 0;
+	char *buf;
+
+	buf = readfile(path, &len);
+	for (i = 0; i < count; i++) {
+		for (n = 0; n < len; n += k) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			/* like ttyread(), an incomplete UTF-8 tail goes again */
+			k = twrite(buf + n, MIN(framesiz, len - n), 0);
+			total += k;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			/* a frame, as in run() */
+			draw();
+			tpackhist();
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+			parse += NSEC(t1) - NSEC(t0);
+			render += NSEC(t2) - NSEC(t1);
+			frames++;
+			if (k == 0)
+				break;
+		}
+	}
+	free(buf);
+
+	fprintf(out, "%s: %zu bytes, %d frames\n", path, total, frames);
+	/* nothing went through, there is no rate to report */
+	if (total == 0 || frames == 0)
+		return;
+	fprintf(out, "  twrite: %.1f MB/s, %.2f ns/byte\n",
+	        total / (parse / 1E9) / 1E6, parse / total);
+	fprintf(out, "  draw:   %.1f us/frame\n", render / frames / 1E3);
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-f framesize] [-g colsxrows] [-n count] file ...\n",
+	    argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *out;
+	int fd;
+
+	ARGBEGIN {
+	case 'f':
+		framesiz = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	case 'g':
+		if (sscanf(EARGF(usage()), "%dx%d", &cols, &rows) != 2)
+			usage();
+		break;
+	case 'n':
+		count = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc == 0 || cols < 1 || rows < 1 || framesiz < 4 || count < 1)
+		usage();
+
+	/*
+	 * Replies to the "shell" go to st's tty, which is stdin here, and
+	 * printer output to stdout. Send both to /dev/null.
+	 */
+	if ((fd = open("/dev/null", O_RDWR)) < 0)
+		die("open /dev/null failed: %s\n", strerror(errno));
+	if (!(out = fdopen(dup(STDOUT_FILENO), "w")))
+		die("fdopen failed: %s\n", strerror(errno));
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	setlocale(LC_CTYPE, "");
+	glyphbuf = xmalloc(cols * sizeof(*glyphbuf));
+	tnew(cols, rows);
+	selinit();
+	for (; argc > 0; argc--, argv++)
+		bench(out, argv[0]);
+
+	return 0;
+}
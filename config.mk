@@ -10,6 +10,9 @@ MANPREFIX = $(PREFIX)/share/man
 X11INC = /usr/X11R6/include
 X11LIB = /usr/X11R6/lib
 
+# Unicode character database, for make width
+UCD = /usr/share/unicode
+
 PKG_CONFIG = pkg-config
 
 # includes and libs
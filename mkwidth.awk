@@ -0,0 +1,117 @@
+#!/usr/bin/awk -f
+#
+# Generates width_data.h, the column width of every code point, from the
+# Unicode character database:
+#
+#	awk -f mkwidth.awk UnicodeData.txt EastAsianWidth.txt > width_data.h
+#
+# Widths are 0 for combining and format characters, 2 for East Asian wide
+# and fullwidth ones, 3 for East Asian ambiguous ones (1 or 2 depending on
+# ambiguouswidth in config.h) and 1 for everything else.
+#
+# The table has two levels: widthidx maps the top bits of a code point to
+# one of the distinct 256 code point blocks in widthblk, which holds four
+# 2-bit widths per byte.
+
+function hex(s,    i, n)
+{
+	n = 0;
+	s = toupper(s);
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1;
+	return n;
+}
+
+function setrange(lo, hi, w,    i)
+{
+	for (i = lo; i <= hi; i++)
+		width[i] = w;
+}
+
+BEGIN {
+	FS = ";";
+	NCP = 1114112;
+
+	# unassigned code points in these ranges default to wide
+	setrange(hex("3400"), hex("4DBF"), 2);
+	setrange(hex("4E00"), hex("9FFF"), 2);
+	setrange(hex("F900"), hex("FAFF"), 2);
+	setrange(hex("20000"), hex("2FFFD"), 2);
+	setrange(hex("30000"), hex("3FFFD"), 2);
+}
+
+FILENAME ~ /EastAsianWidth/ {
+	if (!version && match($0, /[0-9]+\.[0-9]+\.[0-9]+/))
+		version = substr($0, RSTART, RLENGTH);
+	sub(/#.*/, "");
+	gsub(/[ \t]/, "");
+	if ($0 == "")
+		next;
+	n = split($1, r, /\.\./);
+	lo = hex(r[1]);
+	hi = n > 1 ? hex(r[2]) : lo;
+	if ($2 == "W" || $2 == "F")
+		setrange(lo, hi, 2);
+	else if ($2 == "A")
+		setrange(lo, hi, 3);
+	else
+		setrange(lo, hi, 1);
+	next;
+}
+
+{
+	# UnicodeData.txt: only zero width categories matter here
+	cp = hex($1);
+	if ($2 !~ /, Last>$/)
+		first = cp;
+	if ($3 == "Mn" || $3 == "Me" || $3 == "Cf")
+		for (i = first; i <= cp; i++)
+			zero[i] = 1;
+}
+
+END {
+	# the soft hyphen and prepended concatenation marks are visible
+	n = split("AD 600 601 602 603 604 605 6DD 70F 890 891 8E2 110BD 110CD",
+	    r, " ");
+	for (i = 1; i <= n; i++)
+		delete zero[hex(r[i])];
+	# Hangul jamo medials and finals join the preceding syllable
+	setrange(hex("1160"), hex("11FF"), 0);
+	setrange(hex("D7B0"), hex("D7FF"), 0);
+	for (i in zero)
+		width[i] = 0;
+
+	nblk = 0;
+	for (b = 0; b < NCP / 256; b++) {
+		s = "";
+		for (i = 0; i < 256; i += 4) {
+			v = 0;
+			for (j = 3; j >= 0; j--) {
+				w = b * 256 + i + j;
+				v = v * 4 + (w in width ? width[w] : 1);
+			}
+			s = s sprintf("%s0x%02x,", (i % 32) ? " " : "\n\t\t", v);
+		}
+		if (!(s in blkid)) {
+			blkid[s] = nblk;
+			blk[nblk++] = s;
+		}
+		idx[b] = blkid[s];
+	}
+	if (nblk > 256) {
+		print "mkwidth.awk: too many blocks" > "/dev/stderr";
+		exit 1;
+	}
+
+	print "/* Generated by mkwidth.awk from Unicode " version "; do not edit. */";
+	print "";
+	printf "static const unsigned char widthidx[%d] = {", NCP / 256;
+	for (b = 0; b < NCP / 256; b++)
+		printf "%s%d,", (b % 16) ? " " : "\n\t", idx[b];
+	print "\n};";
+	print "";
+	printf "static const unsigned char widthblk[%d][64] = {\n", nblk;
+	for (b = 0; b < nblk; b++)
+		printf "\t{%s\n\t},\n", blk[b];
+	print "};";
+}
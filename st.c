@@ -10,15 +10,19 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
 #include "st.h"
 #include "win.h"
+#include "width_data.h"
 
 #if   defined(__linux)
  #include <pty.h>
@@ -28,6 +32,12 @@
  #include <libutil.h>
 #endif
 
+#if defined(__GNUC__) && defined(__x86_64__)
+ #include <immintrin.h>
+ #define UTF8_SIMD
+ #define BASE64_SIMD
+#endif
+
 /* Arbitrary sizes */
 #define UTF_INVALID   0xFFFD
 #define UTF_SIZ       4
@@ -35,7 +45,23 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define HISTSIZE      2000
+#define TTYBUF_MIN    BUFSIZ
+#define TTYBUF_MAX    (1 << 20)
+#define TTYREAD_MAX   (2 << 20) /* bytes handled per ttyread() call */
+#define LINE_RUNS     4         /* attribute runs stored in the line itself */
+#define LINE_CHUNK    128       /* lines a slab grows by, see linealloc() */
+#define HIST_BLOCK    64        /* history lines packed together */
+#define HIST_CHUNK    256       /* history lines the ring starts with */
+#define HIST_PACKS    4         /* blocks tpackhist() packs at most */
+#define HIST_SLACK    8         /* blocks past histcold before scrolling packs */
+#define HIST_INDEX    (HIST_BLOCK * 4) /* line offsets ahead of packed lines */
+#define HIST_VIEWS    8         /* packed blocks kept unpacked for reading */
+#define HIST_TMPS     2         /* history lines widened for reading */
+#define LZ_HASH       4096      /* match table entries of lzpack() */
+#define LINE_SLACK    8         /* line pointers per screen row, see tslide() */
+#define SCROLL_MAX    16        /* scrolls kept for draw() to blit */
+#define ATTR_GCMIN    1024      /* attribute sets kept before collecting */
+#define REC_MAGIC     "st-rec1\n"
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
@@ -43,10 +69,25 @@
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(u && wcschr(worddelimiters, u))
-#define TLINE(y)		((y) < term.scr ? term.hist[((y) + term.histi - \
-				term.scr + HISTSIZE + 1) % HISTSIZE] : \
-				term.line[(y) - term.scr])
-#define TLINE_HIST(y)           ((y) <= HISTSIZE-term.row+2 ? term.hist[(y)] : term.line[(y-HISTSIZE+term.row-3)])
+#define CSIINTER(c)		((c) ? (c) - ' ' + 1 : 0)
+#define HISTBIT(i)		((uint64_t)1 << (i) % HIST_BLOCK)
+#define HISTN()			((int)(term.histhi - term.histlo))
+#define HISTLINE(n)		term.hist[(n) & (term.histcap - 1)]
+#define HISTBLK(bn)		term.histblk[(bn) & (term.blkcap - 1)]
+#define TLINE(y)		((y) < term.scr ? histline(term.histhi - \
+				term.scr + (y)) : term.line[(y) - term.scr])
+#define TLINE_HIST(y)		((y) < HISTN() ? histline(term.histlo + (y)) : \
+				term.line[(y) - HISTN()])
+
+/* cells hold the code point and, above it, the attributes of the cell */
+#define CELL_ATTRS		(ATTR_WRAP|ATTR_WIDE|ATTR_WDUMMY|ATTR_BOXDRAW)
+#define CELL(u, mode)		((u) | (Cell)((mode) & CELL_ATTRS) << 16)
+#define CELL_RUNE		0xFFFFFF
+#define CELL_WRAP		CELL(0, ATTR_WRAP)
+#define CELL_WIDE		CELL(0, ATTR_WIDE)
+#define CELL_WDUMMY		CELL(0, ATTR_WDUMMY)
+#define CELLRUNE(c)		((c) & CELL_RUNE)
+#define CELLMODE(c)		((c) >> 16 & CELL_ATTRS)
 
 enum term_mode {
 	MODE_WRAP        = 1 << 0,
@@ -56,6 +97,7 @@ enum term_mode {
 	MODE_ECHO        = 1 << 4,
 	MODE_PRINT       = 1 << 5,
 	MODE_UTF8        = 1 << 6,
+	MODE_SYNC        = 1 << 7,
 };
 
 enum cursor_movement {
@@ -89,6 +131,13 @@ enum escape_state {
 	ESC_UTF8       = 64,
 };
 
+enum str_state {
+	STR_STORE,  /* collect the string in strescseq.buf */
+	STR_SEL,    /* decode an OSC 52 payload into strescseq.dec */
+	STR_IGNORE, /* drop the rest of the string */
+	STR_LONG,   /* longer than maxstrsiz, drop the whole sequence */
+};
+
 typedef struct {
 	Glyph attr; /* current char attributes */
 	int x;
@@ -114,17 +163,86 @@ typedef struct {
 	int alt;
 } Selection;
 
+/* Columns x1 to x2-1 of a line need drawing, none if x1 >= x2 */
+typedef struct {
+	int x1, x2;
+} Dirty;
+
+/* Lines top to bot moved up by n, down if n is negative */
+typedef struct {
+	int top, bot;
+	int n;
+} Scroll;
+
+/*
+ * HIST_BLOCK history lines histcold lines old and older, packed: runes as
+ * UTF-8 and attribute runs, compressed with lzpack()
+ */
+typedef struct {
+	uchar *data;  /* NULL if the block is in histfile */
+	size_t off;   /* offset in histfile, counted from its creation */
+	uint len;     /* bytes packed */
+	uint rawlen;  /* bytes unpacked */
+} HistBlock;
+
+/* A packed block unpacked for reading, its lines are made as they are read */
+typedef struct {
+	long bn;
+	uchar *raw;
+	uint64_t made; /* lines made from raw, by bit */
+	Line line[HIST_BLOCK]; /* NULL for the lines dropped before packing */
+} HistView;
+
+/*
+ * Unlinked file the packed history goes to if histspill is set. Blocks are
+ * written at its end and dropped from its start, which is cut off once it
+ * is half of the file. It is mapped only to read blocks back.
+ */
+typedef struct {
+	int fd;       /* -1 until opened */
+	uchar *map;   /* the file, mapped for reading */
+	size_t siz;   /* bytes mapped */
+	size_t base;  /* bytes cut off the start */
+	size_t len;   /* bytes in the file */
+} HistFile;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
 	int col;      /* nb col */
 	int maxcol;
-	Line *line;   /* screen */
-	Line *alt;    /* alternate screen */
-	Line hist[HISTSIZE]; /* history buffer */
-	int histi;    /* history index */
+	Line *line;   /* screen, a window over linebuf */
+	Line *alt;    /* alternate screen, a window over altbuf */
+	Line *linebuf;
+	Line *altbuf;
+	/*
+	 * The history holds the lines numbered histlo to histhi - 1, counted
+	 * from the last clear. The lines from hist0 on are in the ring hist,
+	 * the older ones in the packed blocks blk0 to blk1 - 1, line n in
+	 * block n / HIST_BLOCK. Both rings double when they are full.
+	 */
+	Line *hist;
+	int histcap;  /* lines hist can hold, a power of two */
+	long histlo, histhi, hist0;
+	HistBlock *histblk;
+	int blkcap;   /* blocks histblk can hold, a power of two */
+	long blk0, blk1;
+	HistView histview[HIST_VIEWS]; /* oldest first */
+	int nhistview;
+	char **slab;  /* storage of the screen lines, see linealloc() */
+	int nslab;
+	int slabcol;  /* cells a line in the slabs can hold */
+	int nline;    /* lines in the slabs */
+	Line *freeline; /* lines in the slabs not in use */
+	int nfree;
+	Line histtmp[HIST_TMPS]; /* copies read by histline(), by slot */
+	long histtmpi[HIST_TMPS]; /* the history line they copy + 1 */
+	int histtmpcol; /* cells the copies can hold */
+	int histtmpnext; /* slot histline() takes next */
 	int scr;      /* scroll back */
-	int *dirty;   /* dirtyness of lines */
+	Dirty *dirty; /* dirtyness of lines */
+	Scroll scroll[SCROLL_MAX]; /* scrolls since the last draw() */
+	int nscroll;
 	TCursor c;    /* cursor */
 	int ocx;      /* old cursor col */
 	int ocy;      /* old cursor row */
@@ -139,15 +257,23 @@ typedef struct {
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
 } Term;
 
+enum csi_state {
+	CSI_PARAM,  /* parameters, including the private marker */
+	CSI_INTER,  /* intermediate byte */
+	CSI_IGNORE, /* malformed, ignore up to the final byte */
+};
+
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [[ [<priv>] <arg> [;]] [<inter>] <final>] */
 typedef struct {
-	char buf[ESC_BUF_SIZ]; /* raw string */
+	char buf[ESC_BUF_SIZ]; /* raw string, for csidump() */
 	size_t len;            /* raw string length */
+	int state;
 	char priv;
 	int arg[ESC_ARG_SIZ];
 	int narg;              /* nb of args */
-	char mode[2];
+	char inter;            /* intermediate byte, 0 if none */
+	char final;
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -157,27 +283,115 @@ typedef struct {
 	char *buf;             /* allocated raw string */
 	size_t siz;            /* allocation size */
 	size_t len;            /* raw string length */
+	size_t total;          /* bytes received, stored or not */
+	int state;
 	char *args[STR_ARG_SIZ];
-	int narg;              /* nb of args */
+	int narg;              /* nb of args (of ';' while collecting) */
+	char *dec;             /* decoded OSC 52 payload */
+	size_t declen, decsiz;
+	int quad[4];           /* pending base64 digits */
+	int nquad;             /* nb of pending digits, -1 after padding */
 } STREscape;
 
+typedef uint32_t Cell;
+
+typedef struct {
+	ushort x;      /* first column */
+	uint attr;     /* attribute set, an index in attrtab.set */
+} AttrRun;
+
+/*
+ * A line stores the code point of every cell, and the attributes shared by
+ * cells, which rarely change along a line, as runs: run[i] applies from
+ * column run[i].x up to run[i + 1].x. Runs next to each other differ.
+ */
+struct Line_ {
+	AttrRun *run;  /* by first column, run[0].x is 0 */
+	int nrun;      /* runs in use */
+	int runsiz;    /* runs allocated */
+	int col;       /* cells in use, history lines can be narrower */
+	AttrRun inl[LINE_RUNS]; /* run points here until it outgrows it */
+	Cell cell[];
+};
+
+/* bytes a line of col cells takes in a slab, a multiple of 8 */
+#define LINESIZE(col)	((sizeof(struct Line_) + (col) * sizeof(Cell) + 7) & \
+			 ~(size_t)7)
+
+/* Interned attribute sets, a Glyph without the code point and cell attributes */
+typedef struct {
+	Glyph *set;    /* by id */
+	uint n;        /* sets in use */
+	uint siz;      /* sets allocated */
+	uint *hash;    /* id + 1 of the sets by hash, 0 for none */
+	uint hmask;    /* hash size - 1, the size is a power of two */
+	uint gc;       /* drop the sets no line uses once n gets here */
+	Glyph last;    /* the last set looked up */
+	uint lastid;
+} AttrTab;
+
+/* Ring buffer of output to the tty, siz is a power of two */
+typedef struct {
+	char *buf;
+	size_t siz;
+	size_t head;           /* offset of the first pending byte */
+	size_t len;            /* pending bytes */
+} TTYQueue;
+
 static void execsh(char *, char **);
+static void execreplay(void);
+static void recwrite(const char *, size_t);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static int csiparse(Rune);
 static void csireset(void);
+static int csiich(void);
+static int csicuu(void);
+static int csicud(void);
+static int csimc(void);
+static int csida(void);
+static int csirep(void);
+static int csicuf(void);
+static int csicub(void);
+static int csicnl(void);
+static int csicpl(void);
+static int csitbc(void);
+static int csicha(void);
+static int csicup(void);
+static int csicht(void);
+static int csied(void);
+static int csiel(void);
+static int csisu(void);
+static int csisd(void);
+static int csiil(void);
+static int csirm(void);
+static int csidl(void);
+static int csiech(void);
+static int csidch(void);
+static int csicbt(void);
+static int csivpa(void);
+static int csism(void);
+static int csisgr(void);
+static int csidsr(void);
+static int csidecstbm(void);
+static int csidecsc(void);
+static int csidecrc(void);
+static int csidecscusr(void);
+static int csidecrqm(void);
 static void osc_color_response(int, int, int);
 static int eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
+static void strput(const char *, size_t);
+static void strputsel(const char *, size_t);
 static void strreset(void);
 
-static void tprinter(char *, size_t);
+static void tprinter(const char *, size_t);
 static void tdumpsel(void);
 static void tdumpline(int);
 static void tdump(void);
@@ -193,16 +407,20 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputrun(const Rune *, int);
+static void tputrunes(const Rune *, int);
 static void treset(void);
 static void tscrollup(int, int, int);
 static void tscrolldown(int, int, int);
+static void tslide(int);
 static void tsetattr(const int *, int);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
+static void tsetdirtx(int, int, int);
+static void tsetdirtscroll(int, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetmode(int, int, const int *, int);
-static int twrite(const char *, int, int);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
@@ -210,6 +428,44 @@ static int32_t tdefcolor(const int *, int *, int);
 static void tdeftran(char);
 static void tstrsequence(uchar);
 
+static uint attrhash(const Glyph *);
+static void attrrehash(void);
+static uint tattrid(const Glyph *);
+static void tattrgc(void);
+static Line linealloc(void);
+static void slabpack(int, int);
+static void linerunsiz(Line, int);
+static Line lineinit(Line, int, uint);
+static void linefree(Line);
+static Line linecopy(Line, Line);
+static void linewiden(Line, int, uint);
+static Line histlinecopy(Line, uint);
+static void histlinefree(Line);
+static Line histline(long);
+static void histpush(Line);
+static void histpack(void);
+static HistView *histunpack(long);
+static Line histmake(HistView *, int);
+static void histclose(HistView *);
+static void histfree(long);
+static void histclear(void);
+static int spillopen(void);
+static void spillcompact(void);
+static uchar *spilldata(HistBlock *);
+static int spillblock(HistBlock *);
+static uchar *putvarint(uchar *, uint);
+static const uchar *getvarint(const uchar *, uint *);
+static size_t lzpack(const uchar *, size_t, uchar *);
+static void lzputlen(uchar **, size_t);
+static uchar *lzputseq(uchar *, const uchar *, size_t, size_t, size_t);
+static size_t lzgetlen(const uchar **, size_t);
+static size_t lzunpack(const uchar *, size_t, uchar *, size_t);
+static int linerun(Line, int);
+static void linesetattr(Line, int, int, uint);
+static void linemove(Line, int, int, int);
+static ushort linemode(Line, int);
+static void lineundummy(Line, int);
+
 static void drawregion(int, int, int, int);
 
 static void selnormalize(void);
@@ -220,9 +476,19 @@ static size_t utf8decode(const char *, Rune *, size_t);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
+static int runewidth(Rune);
+static size_t utf8decoderun(const char *, size_t, Rune *, size_t *);
+static size_t utf8decodeascii(const char *, size_t, Rune *, size_t, size_t *);
+#ifdef UTF8_SIMD
+static size_t utf8decodesse2(const char *, size_t, Rune *, size_t, size_t *);
+static size_t utf8decodeavx2(const char *, size_t, Rune *, size_t, size_t *);
+#endif
 
-static char *base64dec(const char *);
-static char base64dec_getc(const char **);
+static int base64quad(const int *, char **);
+static size_t base64decquads(const char *, size_t, char *);
+#ifdef BASE64_SIMD
+static size_t base64decavx2(const char *, size_t, char *);
+#endif
 
 static ssize_t xwrite(int, const char *, size_t);
 
@@ -231,14 +497,76 @@ static Term term;
 static Selection sel;
 static CSIEscape csiescseq;
 static STREscape strescseq;
+static TTYQueue ttyq;
+static HistFile histfile = { .fd = -1 };
+static AttrTab attrtab = { .gc = ATTR_GCMIN, .lastid = -1 };
 static int iofd = 1;
 static int cmdfd;
+static int recfd = -1;
+static int replayfd = -1;
+static int replayfast;
 static pid_t pid;
+static struct timespec synctime; /* when the synchronized update began */
+static int syncdone; /* one ended in the last twrite(), its frame is due */
+
+/* CSI sequence handlers by intermediate and final byte */
+static int (*csihandler[CSIINTER('/') + 1]['~' - '@' + 1])(void) = {
+	[0] = {
+		['@' - '@'] = csiich,
+		['A' - '@'] = csicuu,
+		['B' - '@'] = csicud,
+		['C' - '@'] = csicuf,
+		['D' - '@'] = csicub,
+		['E' - '@'] = csicnl,
+		['F' - '@'] = csicpl,
+		['G' - '@'] = csicha,
+		['H' - '@'] = csicup,
+		['I' - '@'] = csicht,
+		['J' - '@'] = csied,
+		['K' - '@'] = csiel,
+		['L' - '@'] = csiil,
+		['M' - '@'] = csidl,
+		['P' - '@'] = csidch,
+		['S' - '@'] = csisu,
+		['T' - '@'] = csisd,
+		['X' - '@'] = csiech,
+		['Z' - '@'] = csicbt,
+		['`' - '@'] = csicha,
+		['a' - '@'] = csicuf,
+		['b' - '@'] = csirep,
+		['c' - '@'] = csida,
+		['d' - '@'] = csivpa,
+		['e' - '@'] = csicud,
+		['f' - '@'] = csicup,
+		['g' - '@'] = csitbc,
+		['h' - '@'] = csism,
+		['i' - '@'] = csimc,
+		['l' - '@'] = csirm,
+		['m' - '@'] = csisgr,
+		['n' - '@'] = csidsr,
+		['r' - '@'] = csidecstbm,
+		['s' - '@'] = csidecsc,
+		['u' - '@'] = csidecrc,
+	},
+	[CSIINTER(' ')] = {
+		['q' - '@'] = csidecscusr,
+	},
+	[CSIINTER('$')] = {
+		['p' - '@'] = csidecrqm,
+	},
+};
 
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static const Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+static const char base64_digits[256] = {
+	[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+	0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0,
+	0, 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
+	40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
+};
 
 ssize_t
 xwrite(int fd, const char *s, size_t len)
@@ -360,51 +688,266 @@ utf8validate(Rune *u, size_t i)
 	return i;
 }
 
-char
-base64dec_getc(const char **src)
+/* columns taken by u, from the tables made by mkwidth.awk */
+int
+runewidth(Rune u)
 {
-	while (**src && !isprint((unsigned char)**src))
-		(*src)++;
-	return **src ? *((*src)++) : '=';  /* emulate padding if string ends */
+	int w;
+
+	if (u >= 0x110000)
+		return 1;
+	w = widthblk[widthidx[u >> 8]][(u & 0xff) >> 2] >> ((u & 3) << 1) & 3;
+
+	return w == 3 ? ambiguouswidth : w;
 }
 
-char *
-base64dec(const char *src)
-{
-	size_t in_len = strlen(src);
-	char *result, *dst;
-	static const char base64_digits[256] = {
-		[43] = 62, 0, 0, 0, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-		0, 0, 0, -1, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
-		13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0,
-		0, 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
-		40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
-	};
+/*
+ * Decode printable characters from c into at most *ulen runes, stopping
+ * before a control character or an incomplete sequence. Invalid input
+ * decodes as with utf8decode(). Returns the number of bytes consumed.
+ */
+size_t
+utf8decoderun(const char *c, size_t clen, Rune *u, size_t *ulen)
+{
+	static size_t (*decode)(const char *, size_t, Rune *, size_t,
+	                        size_t *);
+	size_t i = 0, j = 0, k, n;
+	Rune r;
+
+	if (!decode) {
+		decode = utf8decodeascii;
+#ifdef UTF8_SIMD
+		__builtin_cpu_init();
+		decode = __builtin_cpu_supports("avx2") ?
+		         utf8decodeavx2 : utf8decodesse2;
+#endif
+	}
+
+	while (i < clen && j < *ulen) {
+		/* the bulk of it, then one code point at a time */
+		i += decode(c + i, clen - i, u + j, *ulen - j, &n);
+		j += n;
+		if (i == clen || j == *ulen)
+			break;
+		if (!(k = utf8decode(c + i, &r, clen - i)) || ISCONTROL(r))
+			break;
+		u[j++] = r;
+		i += k;
+	}
+	*ulen = j;
+
+	return i;
+}
+
+size_t
+utf8decodeascii(const char *c, size_t clen, Rune *u, size_t ulen, size_t *n)
+{
+	size_t i;
 
-	if (in_len % 4)
-		in_len += 4 - (in_len % 4);
-	result = dst = xmalloc(in_len / 4 * 3 + 1);
-	while (*src) {
-		int a = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int b = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int c = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int d = base64_digits[(unsigned char) base64dec_getc(&src)];
-
-		/* invalid input. 'a' can be -1, e.g. if src is "\n" (c-str) */
-		if (a == -1 || b == -1)
+	for (i = 0; i < clen && i < ulen && BETWEEN(c[i], ' ', '~'); i++)
+		u[i] = c[i];
+	*n = i;
+
+	return i;
+}
+
+#ifdef UTF8_SIMD
+/* 16 bytes at a time, printable ASCII only */
+size_t
+utf8decodesse2(const char *c, size_t clen, Rune *u, size_t ulen, size_t *n)
+{
+	const __m128i z = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	const __m128i sp = _mm_set1_epi8(' ');
+	__m128i v, lo, hi;
+	size_t i = 0;
+	uint m;
+
+	while (i + 16 <= clen && i + 16 <= ulen) {
+		v = _mm_loadu_si128((const __m128i *)(c + i));
+		/* ' ' <= b <= '~' is b + 1 > ' ' as a signed byte */
+		m = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_add_epi8(v, one), sp));
+		lo = _mm_unpacklo_epi8(v, z);
+		hi = _mm_unpackhi_epi8(v, z);
+		_mm_storeu_si128((__m128i *)(u + i), _mm_unpacklo_epi16(lo, z));
+		_mm_storeu_si128((__m128i *)(u + i + 4), _mm_unpackhi_epi16(lo, z));
+		_mm_storeu_si128((__m128i *)(u + i + 8), _mm_unpacklo_epi16(hi, z));
+		_mm_storeu_si128((__m128i *)(u + i + 12), _mm_unpackhi_epi16(hi, z));
+		if (m != 0xFFFF) {
+			i += __builtin_ctz(~m);
 			break;
+		}
+		i += 16;
+	}
+	for (; i < clen && i < ulen && BETWEEN(c[i], ' ', '~'); i++)
+		u[i] = c[i];
+	*n = i;
 
-		*dst++ = (a << 2) | ((b & 0x30) >> 4);
-		if (c == -1)
+	return i;
+}
+
+/* 32 bytes of printable ASCII or 24 bytes of 3 byte sequences at a time */
+__attribute__((target("avx2")))
+size_t
+utf8decodeavx2(const char *c, size_t clen, Rune *u, size_t ulen, size_t *n)
+{
+	const __m256i one = _mm256_set1_epi8(1), sp = _mm256_set1_epi8(' ');
+	const __m256i shuf = _mm256_setr_epi8(
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	__m256i v, r, ok;
+	size_t i = 0, j = 0, k;
+	uint m;
+
+	for (;;) {
+		if (i + 32 <= clen && j + 32 <= ulen && (uchar)c[i] < 0x80) {
+			v = _mm256_loadu_si256((const __m256i *)(c + i));
+			m = _mm256_movemask_epi8(_mm256_cmpgt_epi8(
+				_mm256_add_epi8(v, one), sp));
+			for (k = 0; k < 32; k += 8) {
+				_mm256_storeu_si256((__m256i *)(u + j + k),
+					_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(c + i + k))));
+			}
+			k = (m == 0xFFFFFFFF) ? 32 : __builtin_ctz(~m);
+			i += k;
+			j += k;
+			if (k == 0)
+				break;
+		} else if (i + 28 <= clen && j + 8 <= ulen &&
+		           ((uchar)c[i] & 0xF0) == 0xE0) {
+			/* lead, continuation, continuation into each lane */
+			v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(c + i))),
+				_mm_loadu_si128((const __m128i *)(c + i + 12)), 1);
+			v = _mm256_shuffle_epi8(v, shuf);
+			ok = _mm256_cmpeq_epi32(
+				_mm256_and_si256(v, _mm256_set1_epi32(0xF0C0C0)),
+				_mm256_set1_epi32(0xE08080));
+			r = _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(v, _mm256_set1_epi32(0x3F)),
+				_mm256_and_si256(_mm256_srli_epi32(v, 2),
+				                 _mm256_set1_epi32(0xFC0))),
+				_mm256_and_si256(_mm256_srli_epi32(v, 4),
+				                 _mm256_set1_epi32(0xF000)));
+			/* no overlong forms or surrogates */
+			ok = _mm256_and_si256(ok, _mm256_cmpgt_epi32(r,
+				_mm256_set1_epi32(0x7FF)));
+			ok = _mm256_andnot_si256(_mm256_cmpeq_epi32(
+				_mm256_and_si256(r, _mm256_set1_epi32(0xF800)),
+				_mm256_set1_epi32(0xD800)), ok);
+			_mm256_storeu_si256((__m256i *)(u + j), r);
+			m = _mm256_movemask_epi8(ok);
+			k = (m == 0xFFFFFFFF) ? 8 : __builtin_ctz(~m) / 4;
+			i += 3 * k;
+			j += k;
+			if (k == 0)
+				break;
+		} else {
 			break;
-		*dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-		if (d == -1)
+		}
+	}
+	for (; i < clen && j < ulen && BETWEEN(c[i], ' ', '~'); i++, j++)
+		u[j] = c[i];
+	*n = j;
+
+	return i;
+}
+#endif
+
+/*
+ * Emits the bytes of one quad of base64 digits. Returns 0 if padding (or
+ * an invalid digit, -1) ends the data.
+ */
+int
+base64quad(const int *q, char **d)
+{
+	if (q[0] == -1 || q[1] == -1)
+		return 0;
+	*(*d)++ = (q[0] << 2) | ((q[1] & 0x30) >> 4);
+	if (q[2] == -1)
+		return 0;
+	*(*d)++ = ((q[1] & 0x0f) << 4) | ((q[2] & 0x3c) >> 2);
+	if (q[3] == -1)
+		return 0;
+	*(*d)++ = ((q[2] & 0x03) << 6) | q[3];
+	return 1;
+}
+
+/*
+ * Decodes whole quads of printable digits, up to the first padding or
+ * unprintable character. Returns the number of characters consumed; each
+ * quad yields 3 bytes.
+ */
+size_t
+base64decquads(const char *s, size_t len, char *d)
+{
+	size_t i;
+	int k, q[4];
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		for (k = 0; k < 4; k++) {
+			if (!BETWEEN(s[i + k], ' ', '~') || s[i + k] == '=')
+				return i;
+			q[k] = base64_digits[(uchar)s[i + k]];
+		}
+		base64quad(q, &d);
+	}
+
+	return i;
+}
+
+#ifdef BASE64_SIMD
+/*
+ * 32 digits at a time: each byte is classified by its nibbles, which also
+ * gives the offset to its value, then the sextets are packed to 24 bytes.
+ * Anything outside of the alphabet is left to base64decquads(). Stores 32
+ * bytes at a time, so d must have room for 8 bytes past the output.
+ */
+__attribute__((target("avx2")))
+size_t
+base64decavx2(const char *s, size_t len, char *d)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i mask = _mm256_set1_epi8(0x2f);
+	__m256i v, hi, lo, roll;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32, d += 24) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask);
+		lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask));
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(
+		       _mm256_cmpeq_epi8(v, mask), hi));
+		hi = _mm256_shuffle_epi8(lut_hi, hi);
+		if (!_mm256_testz_si256(lo, hi))
 			break;
-		*dst++ = ((c & 0x03) << 6) | d;
+		v = _mm256_add_epi8(v, roll);
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack);
+		v = _mm256_permutevar8x32_epi32(v,
+		    _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *)d, v);
 	}
-	*dst = '\0';
-	return result;
+
+	return i + base64decquads(s + i, len - i, d);
 }
+#endif
 
 void
 selinit(void)
@@ -417,12 +960,13 @@ selinit(void)
 int
 tlinelen(int y)
 {
+	const Cell *cell = TLINE(y)->cell;
 	int i = term.col;
 
-	if (TLINE(y)[i - 1].mode & ATTR_WRAP)
+	if (cell[i - 1] & CELL_WRAP)
 		return i;
 
-	while (i > 0 && TLINE(y)[i - 1].u == ' ')
+	while (i > 0 && CELLRUNE(cell[i - 1]) == ' ')
 		--i;
 
 	return i;
@@ -431,12 +975,13 @@ tlinelen(int y)
 int
 tlinehistlen(int y)
 {
+	const Cell *cell = TLINE_HIST(y)->cell;
 	int i = term.col;
 
-	if (TLINE_HIST(y)[i - 1].mode & ATTR_WRAP)
+	if (cell[i - 1] & CELL_WRAP)
 		return i;
 
-	while (i > 0 && TLINE_HIST(y)[i - 1].u == ' ')
+	while (i > 0 && CELLRUNE(cell[i - 1]) == ' ')
 		--i;
 
 	return i;
@@ -517,6 +1062,25 @@ selnormalize(void)
 		sel.ne.x = term.col - 1;
 }
 
+/* the columns x1 to x2 selected on row y, 0 if none are */
+int
+selectedcols(int y, int *x1, int *x2)
+{
+	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
+			sel.alt != IS_SET(MODE_ALTSCREEN) ||
+			!BETWEEN(y, sel.nb.y, sel.ne.y))
+		return 0;
+
+	if (sel.type == SEL_RECTANGULAR) {
+		*x1 = sel.nb.x;
+		*x2 = sel.ne.x;
+	} else {
+		*x1 = y == sel.nb.y ? sel.nb.x : 0;
+		*x2 = y == sel.ne.y ? sel.ne.x : INT_MAX;
+	}
+	return 1;
+}
+
 int
 selected(int x, int y)
 {
@@ -538,7 +1102,7 @@ selsnap(int *x, int *y, int direction)
 {
 	int newx, newy, xt, yt;
 	int delim, prevdelim;
-	const Glyph *gp, *prevgp;
+	Cell c, prevc;
 
 	switch (sel.snap) {
 	case SNAP_WORD:
@@ -546,8 +1110,8 @@ selsnap(int *x, int *y, int direction)
 		 * Snap around if the word wraps around at the end or
 		 * beginning of a line.
 		 */
-		prevgp = &TLINE(*y)[*x];
-		prevdelim = ISDELIM(prevgp->u);
+		prevc = TLINE(*y)->cell[*x];
+		prevdelim = ISDELIM(CELLRUNE(prevc));
 		for (;;) {
 			newx = *x + direction;
 			newy = *y;
@@ -561,22 +1125,22 @@ selsnap(int *x, int *y, int direction)
 					yt = *y, xt = *x;
 				else
 					yt = newy, xt = newx;
-				if (!(TLINE(yt)[xt].mode & ATTR_WRAP))
+				if (!(TLINE(yt)->cell[xt] & CELL_WRAP))
 					break;
 			}
 
 			if (newx >= tlinelen(newy))
 				break;
 
-			gp = &TLINE(newy)[newx];
-			delim = ISDELIM(gp->u);
-			if (!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim
-					|| (delim && gp->u != prevgp->u)))
+			c = TLINE(newy)->cell[newx];
+			delim = ISDELIM(CELLRUNE(c));
+			if (!(c & CELL_WDUMMY) && (delim != prevdelim
+					|| (delim && CELLRUNE(c) != CELLRUNE(prevc))))
 				break;
 
 			*x = newx;
 			*y = newy;
-			prevgp = gp;
+			prevc = c;
 			prevdelim = delim;
 		}
 		break;
@@ -589,15 +1153,15 @@ selsnap(int *x, int *y, int direction)
 		*x = (direction < 0) ? 0 : term.col - 1;
 		if (direction < 0) {
 			for (; *y > 0; *y += direction) {
-				if (!(TLINE(*y-1)[term.col-1].mode
-						& ATTR_WRAP)) {
+				if (!(TLINE(*y-1)->cell[term.col-1]
+						& CELL_WRAP)) {
 					break;
 				}
 			}
 		} else if (direction > 0) {
 			for (; *y < term.row-1; *y += direction) {
-				if (!(TLINE(*y)[term.col-1].mode
-						& ATTR_WRAP)) {
+				if (!(TLINE(*y)->cell[term.col-1]
+						& CELL_WRAP)) {
 					break;
 				}
 			}
@@ -611,7 +1175,7 @@ getsel(void)
 {
 	char *str, *ptr;
 	int y, bufsize, lastx, linelen;
-	const Glyph *gp, *last;
+	const Cell *gp, *last;
 
 	if (sel.ob.x == -1)
 		return NULL;
@@ -627,21 +1191,21 @@ getsel(void)
 		}
 
 		if (sel.type == SEL_RECTANGULAR) {
-			gp = &TLINE(y)[sel.nb.x];
+			gp = &TLINE(y)->cell[sel.nb.x];
 			lastx = sel.ne.x;
 		} else {
-			gp = &TLINE(y)[sel.nb.y == y ? sel.nb.x : 0];
+			gp = &TLINE(y)->cell[sel.nb.y == y ? sel.nb.x : 0];
 			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
 		}
-		last = &TLINE(y)[MIN(lastx, linelen-1)];
-		while (last >= gp && last->u == ' ')
+		last = &TLINE(y)->cell[MIN(lastx, linelen-1)];
+		while (last >= gp && CELLRUNE(*last) == ' ')
 			--last;
 
 		for ( ; gp <= last; ++gp) {
-			if (gp->mode & ATTR_WDUMMY)
+			if (*gp & CELL_WDUMMY)
 				continue;
 
-			ptr += utf8encode(gp->u, ptr);
+			ptr += utf8encode(CELLRUNE(*gp), ptr);
 		}
 
 		/*
@@ -654,7 +1218,7 @@ getsel(void)
 		 * FIXME: Fix the computer world.
 		 */
 		if ((y < sel.ne.y || lastx >= linelen) &&
-		    (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
+		    (!(*last & CELL_WRAP) || sel.type == SEL_RECTANGULAR))
 			*ptr++ = '\n';
 	}
 	*ptr = 0;
@@ -734,6 +1298,71 @@ execsh(char *cmd, char **args)
 	_exit(1);
 }
 
+/*
+ * Runs in place of the shell for -P: writes the chunks of a log made by
+ * -R to the tty, as they were timed or as fast as it takes them.
+ */
+void
+execreplay(void)
+{
+	struct termios tio;
+	struct timespec due;
+	uint64_t v[2];
+	char *buf = NULL;
+	size_t bufsiz = 0;
+	int i, c, sh;
+	FILE *f;
+
+	signal(SIGHUP, SIG_DFL);
+
+	/* pass the chunks on untouched and don't echo st's replies */
+	if (tcgetattr(1, &tio) == 0) {
+		tio.c_oflag &= ~OPOST;
+		tio.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+		tcsetattr(1, TCSANOW, &tio);
+	}
+
+	if (!(f = fdopen(replayfd, "r")))
+		die("fdopen failed: %s\n", strerror(errno));
+	buf = xmalloc(bufsiz = BUFSIZ);
+	if (fread(buf, 1, sizeof(REC_MAGIC) - 1, f) != sizeof(REC_MAGIC) - 1 ||
+	    memcmp(buf, REC_MAGIC, sizeof(REC_MAGIC) - 1))
+		die("replay: not a log made by st -R\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	for (;;) {
+		/* delay in microseconds and length, as LEB128 varints */
+		for (i = 0; i < 2; i++) {
+			for (v[i] = 0, sh = 0; (c = getc(f)) != EOF; sh += 7) {
+				v[i] |= (uint64_t)(c & 0x7f) << sh;
+				if (!(c & 0x80))
+					break;
+			}
+			if (c == EOF)
+				goto done;
+		}
+		if (v[1] > bufsiz)
+			buf = xrealloc(buf, bufsiz = v[1]);
+		if (fread(buf, 1, v[1], f) != v[1])
+			break;
+
+		if (!replayfast) {
+			due.tv_sec += (due.tv_nsec / 1000 + v[0]) / 1000000;
+			due.tv_nsec = (due.tv_nsec / 1000 + v[0]) % 1000000 * 1000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                       &due, NULL) == EINTR)
+				;
+		}
+		if (xwrite(1, buf, v[1]) < 0)
+			_exit(1);
+	}
+done:
+	/* keep the window around until it is closed */
+	while (read(0, buf, bufsiz) > 0)
+		;
+	_exit(0);
+}
+
 void
 sigchld(int a)
 {
@@ -777,6 +1406,24 @@ stty(char **args)
 		perror("Couldn't call stty");
 }
 
+void
+ttyrecord(const char *path)
+{
+	if ((recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		die("open %s failed: %s\n", path, strerror(errno));
+	if (xwrite(recfd, REC_MAGIC, sizeof(REC_MAGIC) - 1) < 0)
+		die("write %s failed: %s\n", path, strerror(errno));
+	recwrite(NULL, 0);
+}
+
+void
+ttyreplay(const char *path, int fast)
+{
+	if ((replayfd = open(path, O_RDONLY)) < 0)
+		die("open %s failed: %s\n", path, strerror(errno));
+	replayfast = fast;
+}
+
 int
 ttynew(const char *line, char *cmd, const char *out, char **args)
 {
@@ -798,6 +1445,7 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		return cmdfd;
 	}
 
@@ -811,6 +1459,8 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 		break;
 	case 0:
 		close(iofd);
+		if (recfd != -1)
+			close(recfd);
 		close(m);
 		setsid(); /* create a new process group */
 		dup2(s, 0);
@@ -824,6 +1474,8 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 		if (pledge("stdio getpw proc exec", NULL) == -1)
 			die("pledge\n");
 #endif
+		if (replayfd != -1)
+			execreplay();
 		execsh(cmd, args);
 		break;
 	default:
@@ -832,7 +1484,11 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 			die("pledge\n");
 #endif
 		close(s);
+		if (replayfd != -1)
+			close(replayfd);
 		cmdfd = m;
+		/* ttyread() and ttyflush() go on until the tty would block */
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
 		break;
 	}
@@ -842,27 +1498,60 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
+	static char *buf;
+	static size_t bufsiz, buflen;
+	size_t total = 0;
+	ssize_t ret;
+	int written, full;
 
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	if (!buf)
+		buf = xmalloc(bufsiz = TTYBUF_MIN);
 
-	switch (ret) {
-	case 0:
-		exit(0);
-	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
-	default:
+	/* go on after the frame of a synchronized update */
+	if (syncdone) {
+		written = twrite(buf, buflen, 0);
+		buflen -= written;
+		memmove(buf, buf + written, buflen);
+		if (syncdone)
+			return 0;
+	}
+
+	/* drain the tty until it would block or the budget is spent */
+	while (total < TTYREAD_MAX) {
+		/* append read bytes to unprocessed bytes */
+		ret = read(cmdfd, buf+buflen, bufsiz-buflen);
+		if (ret == 0)
+			exit(0);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			die("couldn't read from shell: %s\n", strerror(errno));
+		}
+		if (recfd != -1)
+			recwrite(buf + buflen, ret);
+		total += ret;
 		buflen += ret;
+		full = buflen == bufsiz;
+
 		written = twrite(buf, buflen, 0);
 		buflen -= written;
-		/* keep any incomplete UTF-8 byte sequence for the next call */
+		/* keep any incomplete UTF-8 byte sequence for later */
 		if (buflen > 0)
 			memmove(buf, buf + written, buflen);
-		return ret;
+		/* or what follows a synchronized update, until it is drawn */
+		if (syncdone)
+			break;
+
+		/* the read filled the buffer: expect more next time */
+		if (full && bufsiz < TTYBUF_MAX)
+			buf = xrealloc(buf, bufsiz *= 2);
 	}
+
+	/* give memory back once the output rate drops */
+	if (total < bufsiz / 4 && bufsiz > TTYBUF_MIN)
+		buf = xrealloc(buf, bufsiz /= 2);
+
+	return total;
 }
 
 void
@@ -878,6 +1567,7 @@ ttywrite(const char *s, size_t n, int may_echo)
 
 	if (!IS_SET(MODE_CRLF)) {
 		ttywriteraw(s, n);
+		ttyflush();
 		return;
 	}
 
@@ -894,63 +1584,80 @@ ttywrite(const char *s, size_t n, int may_echo)
 		n -= next - s;
 		s = next;
 	}
+	ttyflush();
 }
 
+/*
+ * Queues bytes for the tty. They are written by ttyflush(), right away if
+ * the tty takes them and from the main loop otherwise, so a slow reader
+ * on the other side never blocks the terminal.
+ */
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
-	ssize_t r;
-	size_t lim = 256;
+	char *buf;
+	size_t i, k, siz;
+
+	if (ttyq.len + n > ttyq.siz) {
+		for (siz = MAX(ttyq.siz, TTYBUF_MIN); siz < ttyq.len + n; )
+			siz *= 2;
+		/* unwrap the pending bytes at the start of the new buffer */
+		buf = xmalloc(siz);
+		k = MIN(ttyq.len, ttyq.siz - ttyq.head);
+		memcpy(buf, ttyq.buf + ttyq.head, k);
+		memcpy(buf + k, ttyq.buf, ttyq.len - k);
+		free(ttyq.buf);
+		ttyq.buf = buf;
+		ttyq.siz = siz;
+		ttyq.head = 0;
+	}
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
-	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
+	i = (ttyq.head + ttyq.len) & (ttyq.siz - 1);
+	k = MIN(n, ttyq.siz - i);
+	memcpy(ttyq.buf + i, s, k);
+	memcpy(ttyq.buf, s + k, n - k);
+	ttyq.len += n;
+}
 
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+/*
+ * Writes as much of the queue as the tty takes without blocking and
+ * returns the number of bytes still pending.
+ */
+size_t
+ttyflush(void)
+{
+	struct iovec iov[2];
+	ssize_t r;
+	size_t k;
+
+	while (ttyq.len > 0) {
+		k = MIN(ttyq.len, ttyq.siz - ttyq.head);
+		iov[0].iov_base = ttyq.buf + ttyq.head;
+		iov[0].iov_len = k;
+		iov[1].iov_base = ttyq.buf;
+		iov[1].iov_len = ttyq.len - k;
+		if ((r = writev(cmdfd, iov, ttyq.len > k ? 2 : 1)) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
+			if (errno == EAGAIN)
 				break;
-			}
+			die("write error on tty: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		ttyq.head = (ttyq.head + r) & (ttyq.siz - 1);
+		ttyq.len -= r;
 	}
-	return;
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	/* give memory back after a large paste */
+	if (ttyq.len == 0) {
+		ttyq.head = 0;
+		if (ttyq.siz > TTYBUF_MIN) {
+			free(ttyq.buf);
+			ttyq.buf = NULL;
+			ttyq.siz = 0;
+		}
+	}
+
+	return ttyq.len;
 }
 
 void
@@ -973,78 +1680,1150 @@ ttyhangup(void)
 	kill(pid, SIGHUP);
 }
 
-int
-tattrset(int attr)
+uint
+attrhash(const Glyph *g)
 {
-	int i, j;
-
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
-				return 1;
-		}
-	}
+	uint h;
 
-	return 0;
+	h = g->mode * 0x9E3779B1u ^ g->fg * 0x85EBCA77u ^ g->bg * 0xC2B2AE3Du;
+	return h ^ h >> 16;
 }
 
+/* size the hash to keep it at most half full and fill it */
 void
-tsetdirt(int top, int bot)
+attrrehash(void)
 {
-	int i;
+	uint i, h;
+
+	for (attrtab.hmask = 127; attrtab.n * 2 > attrtab.hmask;)
+		attrtab.hmask = attrtab.hmask * 2 + 1;
+	free(attrtab.hash);
+	attrtab.hash = xmalloc((attrtab.hmask + 1) * sizeof(uint));
+	memset(attrtab.hash, 0, (attrtab.hmask + 1) * sizeof(uint));
+	for (i = 0; i < attrtab.n; i++) {
+		for (h = attrhash(&attrtab.set[i]) & attrtab.hmask;
+		     attrtab.hash[h]; h = (h + 1) & attrtab.hmask)
+			;
+		attrtab.hash[h] = i + 1;
+	}
+}
 
-	LIMIT(top, 0, term.row-1);
-	LIMIT(bot, 0, term.row-1);
+/* the id of the attribute set of g, interning it if it is new */
+uint
+tattrid(const Glyph *g)
+{
+	Glyph key = { .mode = g->mode & ~(CELL_ATTRS|ATTR_LIGA),
+	              .fg = g->fg, .bg = g->bg };
+	Glyph *set;
+	uint i, id;
+
+	if (attrtab.lastid != (uint)-1 && key.mode == attrtab.last.mode &&
+	    key.fg == attrtab.last.fg && key.bg == attrtab.last.bg)
+		return attrtab.lastid;
+
+	if (!attrtab.hash)
+		attrrehash();
+	for (i = attrhash(&key) & attrtab.hmask; (id = attrtab.hash[i]);
+	     i = (i + 1) & attrtab.hmask) {
+		set = &attrtab.set[id - 1];
+		if (set->mode == key.mode && set->fg == key.fg &&
+		    set->bg == key.bg) {
+			id--;
+			goto found;
+		}
+	}
 
-	for (i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+	if (attrtab.n == attrtab.gc) {
+		tattrgc();
+		return tattrid(g);
+	}
+	if (attrtab.n == attrtab.siz) {
+		attrtab.siz = attrtab.siz ? attrtab.siz * 2 : 64;
+		attrtab.set = xrealloc(attrtab.set,
+		                       attrtab.siz * sizeof(*attrtab.set));
+	}
+	id = attrtab.n++;
+	attrtab.set[id] = key;
+	if (attrtab.n * 2 > attrtab.hmask)
+		attrrehash();
+	else
+		attrtab.hash[i] = id + 1;
+
+found:
+	attrtab.last = key;
+	attrtab.lastid = id;
+	return id;
 }
 
+/*
+ * Drop the attribute sets no line uses any more and renumber the rest.
+ * Ids got before a tattrid() call are stale after it.
+ */
 void
-tsetdirtattr(int attr)
+tattrgc(void)
 {
-	int i, j;
+	Line *lines[4 + HIST_VIEWS] = {
+		term.line, term.alt, term.hist, term.histtmp
+	};
+	int nlines[4 + HIST_VIEWS] = {
+		term.row, term.row, term.histcap, HIST_TMPS
+	};
+	uint *map, i, n;
+	int j, k, r;
+	Line l;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
-			}
+	for (j = 0; j < term.nhistview; j++) {
+		lines[4 + j] = term.histview[j].line;
+		nlines[4 + j] = HIST_BLOCK;
+	}
+
+	map = xmalloc(attrtab.n * sizeof(uint));
+	memset(map, 0, attrtab.n * sizeof(uint));
+	for (j = 0; j < LEN(lines); j++) {
+		for (k = 0; lines[j] && k < nlines[j]; k++) {
+			if (!(l = lines[j][k]))
+				continue;
+			for (r = 0; r < l->nrun; r++)
+				map[l->run[r].attr] = 1;
+		}
+	}
+
+	for (i = n = 0; i < attrtab.n; i++) {
+		if (map[i]) {
+			attrtab.set[n] = attrtab.set[i];
+			map[i] = n++;
+		}
+	}
+	for (j = 0; j < LEN(lines); j++) {
+		for (k = 0; lines[j] && k < nlines[j]; k++) {
+			if (!(l = lines[j][k]))
+				continue;
+			for (r = 0; r < l->nrun; r++)
+				l->run[r].attr = map[l->run[r].attr];
 		}
 	}
+	free(map);
+
+	attrtab.n = n;
+	attrtab.gc = MAX(ATTR_GCMIN, 2 * n);
+	attrtab.lastid = -1;
+	attrrehash();
 }
 
-void
-tfulldirt(void)
+/* the index of the run holding column x */
+int
+linerun(Line l, int x)
 {
-	tsetdirt(0, term.row-1);
+	int lo = 0, hi = l->nrun - 1, mid;
+
+	/* lines are mostly written at their end */
+	if (l->run[hi].x <= x)
+		return hi;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (l->run[mid].x <= x)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
 }
 
+/* give the columns x1 to x2-1 the attribute set a */
 void
-tcursor(int mode)
+linesetattr(Line l, int x1, int x2, uint a)
 {
-	static TCursor c[2];
-	int alt = IS_SET(MODE_ALTSCREEN);
+	AttrRun add[2];
+	int i, k, end, nadd = 0, delta;
+	uint tail;
 
-	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
-	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+	i = linerun(l, x1);
+	end = i+1 < l->nrun ? l->run[i+1].x : term.maxcol;
+	if (l->run[i].attr == a && end >= x2)
+		return;
+	/* the common case of writing on with the attributes to the left */
+	if (l->run[i].x == x1 && i > 0 && l->run[i-1].attr == a && end > x2) {
+		l->run[i].x = x2;
+		return;
+	}
+	if (l->run[i].x < x1)
+		i++;
+	k = linerun(l, x2 - 1);
+	tail = l->run[k++].attr;
+
+	/* merge with the runs next to the range where they match */
+	if (i == 0 || l->run[i-1].attr != a)
+		add[nadd++] = (AttrRun){ x1, a };
+	end = k;
+	if (x2 < term.maxcol) {
+		if (k < l->nrun && l->run[k].x == x2) {
+			if (l->run[k].attr == a)
+				end++;
+		} else if (tail != a) {
+			add[nadd++] = (AttrRun){ x2, tail };
+		}
 	}
+
+	delta = nadd - (end - i);
+	linerunsiz(l, l->nrun + delta);
+	memmove(&l->run[i + nadd], &l->run[end],
+	        (l->nrun - end) * sizeof(*l->run));
+	memcpy(&l->run[i], add, nadd * sizeof(*l->run));
+	l->nrun += delta;
 }
 
+/* move n cells and their attributes from column src to column dst */
 void
-treset(void)
+linemove(Line l, int dst, int src, int n)
 {
-	uint i;
+	AttrRun *seg;
+	int r, i, nseg;
 
-	term.c = (TCursor){{
-		.mode = ATTR_NULL,
-		.fg = defaultfg,
-		.bg = defaultbg
-	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
+	if (n <= 0 || dst == src)
+		return;
+	memmove(&l->cell[dst], &l->cell[src], n * sizeof(*l->cell));
+
+	r = linerun(l, src);
+	for (nseg = 0; r + nseg < l->nrun && l->run[r + nseg].x < src + n;)
+		nseg++;
+	seg = xmalloc(nseg * sizeof(*seg));
+	for (i = 0; i < nseg; i++) {
+		seg[i].x = MAX(l->run[r + i].x, src) - src + dst;
+		seg[i].attr = l->run[r + i].attr;
+	}
+	for (i = 0; i < nseg; i++)
+		linesetattr(l, seg[i].x, i + 1 < nseg ? seg[i+1].x : dst + n,
+		            seg[i].attr);
+	free(seg);
+}
+
+/* make room for n runs in l */
+void
+linerunsiz(Line l, int n)
+{
+	if (n <= l->runsiz)
+		return;
+	l->runsiz = MAX(l->runsiz * 2, n);
+	if (l->run == l->inl) {
+		l->run = xmalloc(l->runsiz * sizeof(*l->run));
+		memcpy(l->run, l->inl, l->nrun * sizeof(*l->run));
+	} else {
+		l->run = xrealloc(l->run, l->runsiz * sizeof(*l->run));
+	}
+}
+
+/* make l a line of col blanks with the attribute set a */
+Line
+lineinit(Line l, int col, uint a)
+{
+	int i;
+
+	for (i = 0; i < col; i++)
+		l->cell[i] = ' ';
+	l->col = col;
+	l->runsiz = LINE_RUNS;
+	l->run = l->inl;
+	l->run[0] = (AttrRun){ 0, a };
+	l->nrun = 1;
+
+	return l;
+}
+
+/* give l back to the slabs */
+void
+linefree(Line l)
+{
+	if (!l)
+		return;
+	if (l->run != l->inl)
+		free(l->run);
+	term.freeline[term.nfree++] = l;
+}
+
+/* move src to the slot dst */
+Line
+linecopy(Line dst, Line src)
+{
+	memcpy(dst, src, sizeof(*src) + src->col * sizeof(*src->cell));
+	if (src->run == src->inl)
+		dst->run = dst->inl;
+
+	return dst;
+}
+
+/* widen l to col columns, the new ones blanks with the attribute set a */
+void
+linewiden(Line l, int col, uint a)
+{
+	int i;
+
+	if (l->col >= col)
+		return;
+	for (i = l->col; i < col; i++)
+		l->cell[i] = ' ';
+	if (l->col == 0) {
+		l->run[0].attr = a;
+	} else if (l->run[l->nrun-1].attr != a) {
+		linerunsiz(l, l->nrun + 1);
+		l->run[l->nrun++] = (AttrRun){ l->col, a };
+	}
+	l->col = col;
+}
+
+/*
+ * Copy of screen line l for the history, up to its last cell on the screen
+ * that is not a blank with the attribute set a. History lines are not in
+ * the slabs, each one is allocated to the size of its cells.
+ */
+Line
+histlinecopy(Line l, uint a)
+{
+	int col = MIN(l->col, term.col), nrun = l->nrun;
+	AttrRun *r;
+	Line h;
+
+	while (nrun > 1 && l->run[nrun-1].x >= col)
+		nrun--;
+	r = &l->run[nrun-1];
+	if (r->attr == a) {
+		while (col > r->x && l->cell[col-1] == ' ')
+			col--;
+		if (col == r->x && nrun > 1)
+			nrun--;
+	}
+	h = xmalloc(LINESIZE(col));
+	memcpy(h->cell, l->cell, col * sizeof(*h->cell));
+	h->col = col;
+	h->run = h->inl;
+	h->runsiz = LINE_RUNS;
+	h->nrun = 0;
+	linerunsiz(h, nrun);
+	memcpy(h->run, l->run, nrun * sizeof(*h->run));
+	h->nrun = nrun;
+
+	return h;
+}
+
+void
+histlinefree(Line l)
+{
+	if (!l)
+		return;
+	if (l->run != l->inl)
+		free(l->run);
+	free(l);
+}
+
+/*
+ * History line n, for reading. Lines scrolled into the history lose their
+ * trailing default blanks and resizing leaves them as they are. A line
+ * narrower than term.maxcol is read from a copy widened with default
+ * blanks, which stays valid until HIST_TMPS other lines are read. Lines
+ * dropped before their block was packed read as a blank line.
+ */
+Line
+histline(long n)
+{
+	Glyph g = { .fg = defaultfg, .bg = defaultbg };
+	Line l, t;
+	uint a;
+	int k;
+
+	if (n >= term.hist0)
+		l = HISTLINE(n);
+	else
+		l = histmake(histunpack(n / HIST_BLOCK), n % HIST_BLOCK);
+	if (l && l->col >= term.maxcol)
+		return l;
+
+	if (term.histtmpcol < term.maxcol) {
+		for (k = 0; k < HIST_TMPS; k++) {
+			histlinefree(term.histtmp[k]);
+			term.histtmp[k] = lineinit(xmalloc(LINESIZE(term.maxcol)),
+			                           0, 0);
+		}
+		term.histtmpcol = term.maxcol;
+	}
+	/* the same line is read again from the same copy */
+	for (k = 0; k < HIST_TMPS && term.histtmpi[k] != n + 1; k++)
+		;
+	if (k == HIST_TMPS) {
+		k = term.histtmpnext;
+		term.histtmpnext = (k + 1) % HIST_TMPS;
+	}
+	term.histtmpi[k] = n + 1;
+	t = term.histtmp[k];
+
+	a = tattrid(&g);
+	t->col = 0;
+	t->run[0] = (AttrRun){ 0, a };
+	t->nrun = 1;
+	if (l) {
+		linerunsiz(t, l->nrun);
+		memcpy(t->run, l->run, l->nrun * sizeof(*t->run));
+		memcpy(t->cell, l->cell, l->col * sizeof(*t->cell));
+		t->nrun = l->nrun;
+		t->col = l->col;
+	}
+	linewiden(t, term.maxcol, a);
+	return t;
+}
+
+/*
+ * Append l to the history, dropping the oldest line once it holds
+ * histsize lines. The ring of unpacked lines doubles when it is full, up
+ * to histcold lines and HIST_SLACK blocks: past that the oldest block is
+ * packed here, and spilled if histspill is set.
+ */
+void
+histpush(Line l)
+{
+	Line *hist;
+	long n;
+	int cap;
+
+	if (term.histhi - term.histlo == histsize) {
+		if (++term.histlo > term.hist0) {
+			histlinefree(HISTLINE(term.hist0));
+			HISTLINE(term.hist0) = NULL;
+			term.hist0++;
+		}
+		for (; term.blk0 < term.blk1 &&
+		       (term.blk0 + 1) * HIST_BLOCK <= term.histlo; term.blk0++)
+			histfree(term.blk0);
+		if (term.blk0 == term.blk1)
+			term.blk0 = term.blk1 = term.hist0 / HIST_BLOCK;
+	}
+	if (term.histhi - term.hist0 == term.histcap) {
+		cap = term.histcap ? term.histcap * 2 : HIST_CHUNK;
+		hist = xmalloc(cap * sizeof(*hist));
+		memset(hist, 0, cap * sizeof(*hist));
+		for (n = term.hist0; n < term.histhi; n++)
+			hist[n & (cap - 1)] = HISTLINE(n);
+		free(term.hist);
+		term.hist = hist;
+		term.histcap = cap;
+	}
+	HISTLINE(term.histhi++) = l;
+
+	if (MAX(histcold, 1) + HIST_BLOCK <= histsize &&
+	    term.histhi - term.hist0 >= MAX(histcold, 1) +
+	    (HIST_SLACK + 1) * HIST_BLOCK)
+		histpack();
+}
+
+/*
+ * Pack up to HIST_PACKS blocks of history lines that got histcold lines
+ * old. The main loop calls it after each frame, which spreads the packing
+ * over the frames; histpush() packs what a flood leaves past HIST_SLACK.
+ */
+void
+tpackhist(void)
+{
+	long old = MAX(histcold, 1);
+	int i;
+
+	if (old + HIST_BLOCK > histsize)
+		return;
+	for (i = 0; i < HIST_PACKS &&
+	     (term.blk1 + 1) * HIST_BLOCK + old <= term.histhi; i++)
+		histpack();
+}
+
+uchar *
+putvarint(uchar *p, uint v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+const uchar *
+getvarint(const uchar *p, uint *v)
+{
+	int sh;
+
+	for (*v = 0, sh = 0; *p & 0x80; sh += 7)
+		*v |= (uint)(*p++ & 0x7f) << sh;
+	*v |= (uint)*p++ << sh;
+	return p;
+}
+
+/*
+ * Pack the history lines of block term.blk1, the oldest unpacked ones.
+ * The block starts with the offset of each line as 4 bytes, least
+ * significant first. A line is its width plus one, 0 for one dropped
+ * before, its attribute runs as column, mode, fg and bg, and its cells up
+ * to the trailing blanks as UTF-8, cells with cell attributes or a
+ * control code point after a 1 and the attributes.
+ */
+void
+histpack(void)
+{
+	long n, n0 = term.blk1 * HIST_BLOCK, n1 = n0 + HIST_BLOCK;
+	HistBlock *blk, *b;
+	int x, r, len, cap;
+	size_t siz = 0;
+	uchar *raw, *p;
+	Glyph *g;
+	Line l;
+	Rune u;
+
+	if (term.blk1 - term.blk0 == term.blkcap) {
+		cap = term.blkcap ? term.blkcap * 2 : HIST_CHUNK / HIST_BLOCK;
+		blk = xmalloc(cap * sizeof(*blk));
+		for (n = term.blk0; n < term.blk1; n++)
+			blk[n & (cap - 1)] = HISTBLK(n);
+		free(term.histblk);
+		term.histblk = blk;
+		term.blkcap = cap;
+	}
+
+	for (n = MAX(n0, term.hist0); n < n1; n++) {
+		l = HISTLINE(n);
+		siz += 16 + l->nrun * 20 + l->col * (UTF_SIZ + 6);
+	}
+	raw = xmalloc(HIST_INDEX + siz + HIST_BLOCK);
+	for (n = n0, p = raw + HIST_INDEX; n < n1; n++) {
+		for (x = 0; x < 4; x++)
+			raw[(n - n0) * 4 + x] = (p - raw) >> 8 * x;
+		if (n < term.hist0) {
+			*p++ = 0;
+			continue;
+		}
+		l = HISTLINE(n);
+		p = putvarint(p, l->col + 1);
+		p = putvarint(p, l->nrun);
+		for (r = 0; r < l->nrun; r++) {
+			g = &attrtab.set[l->run[r].attr];
+			p = putvarint(p, l->run[r].x);
+			p = putvarint(p, g->mode);
+			p = putvarint(p, g->fg);
+			p = putvarint(p, g->bg);
+		}
+		for (len = l->col; len > 0 && l->cell[len-1] == ' '; len--)
+			;
+		p = putvarint(p, len);
+		for (x = 0; x < len; x++) {
+			u = CELLRUNE(l->cell[x]);
+			if (CELLMODE(l->cell[x]) || u < 0x20) {
+				*p++ = 1;
+				p = putvarint(p, CELLMODE(l->cell[x]));
+			}
+			if (u < 0x80)
+				*p++ = u;
+			else
+				p += utf8encode(u, (char *)p);
+		}
+		histlinefree(l);
+		HISTLINE(n) = NULL;
+	}
+	term.hist0 = n1;
+
+	b = &HISTBLK(term.blk1++);
+	*b = (HistBlock){ 0 };
+	b->rawlen = p - raw;
+	b->data = xmalloc(b->rawlen + b->rawlen / 255 + 16);
+	b->len = lzpack(raw, b->rawlen, b->data);
+	if (!histspill || !spillblock(b))
+		b->data = xrealloc(b->data, b->len);
+	free(raw);
+}
+
+/*
+ * Block bn unpacked. Up to HIST_VIEWS blocks are kept unpacked, the one
+ * unpacked first is dropped for a new one.
+ */
+HistView *
+histunpack(long bn)
+{
+	HistBlock *b = &HISTBLK(bn);
+	HistView *view;
+	int i;
+
+	for (i = 0; i < term.nhistview; i++) {
+		if (term.histview[i].bn == bn)
+			return &term.histview[i];
+	}
+	if (term.nhistview == HIST_VIEWS) {
+		histclose(&term.histview[0]);
+		memmove(term.histview, term.histview + 1,
+		        --term.nhistview * sizeof(*term.histview));
+	}
+	view = &term.histview[term.nhistview++];
+	memset(view, 0, sizeof(*view));
+	view->bn = bn;
+	view->raw = xmalloc(b->rawlen);
+	lzunpack(spilldata(b), b->len, view->raw, b->rawlen);
+	return view;
+}
+
+/* line i of an unpacked block, made from the packed line the first time */
+Line
+histmake(HistView *view, int i)
+{
+	const uchar *p = view->raw + i * 4;
+	int x, r, len;
+	uint v, nrun;
+	Glyph g = { 0 };
+	Rune u;
+	Line l;
+
+	if (view->made & HISTBIT(i))
+		return view->line[i];
+	view->made |= HISTBIT(i);
+	p = view->raw + (p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24);
+	p = getvarint(p, &v);
+	if (!v)
+		return NULL;
+	/* attribute sets can be collected in between, see tattrgc() */
+	view->line[i] = l = xmalloc(LINESIZE(v - 1));
+	l->col = v - 1;
+	l->run = l->inl;
+	l->runsiz = LINE_RUNS;
+	l->nrun = 0;
+	p = getvarint(p, &nrun);
+	linerunsiz(l, nrun);
+	for (r = 0; r < nrun; r++) {
+		p = getvarint(p, &v);
+		l->run[r].x = v;
+		p = getvarint(p, &v);
+		g.mode = v;
+		p = getvarint(p, &v);
+		g.fg = v;
+		p = getvarint(p, &v);
+		g.bg = v;
+		l->run[r].attr = tattrid(&g);
+		l->nrun = r + 1;
+	}
+	p = getvarint(p, &v);
+	len = v;
+	for (x = 0; x < len; x++) {
+		v = 0;
+		if (*p == 1)
+			p = getvarint(p + 1, &v);
+		if (*p < 0x80)
+			u = *p++;
+		else
+			p += utf8decode((const char *)p, &u, UTF_SIZ);
+		l->cell[x] = CELL(u, v);
+	}
+	for (; x < l->col; x++)
+		l->cell[x] = ' ';
+	return l;
+}
+
+/* drop an unpacked block */
+void
+histclose(HistView *view)
+{
+	int i;
+
+	for (i = 0; i < HIST_BLOCK; i++)
+		histlinefree(view->line[i]);
+	free(view->raw);
+	memset(view, 0, sizeof(*view));
+}
+
+/* drop packed block bn, and its view if it is unpacked */
+void
+histfree(long bn)
+{
+	HistBlock *b = &HISTBLK(bn);
+	int i;
+
+	for (i = 0; i < term.nhistview; i++) {
+		if (term.histview[i].bn != bn)
+			continue;
+		histclose(&term.histview[i]);
+		memmove(&term.histview[i], &term.histview[i+1],
+		        (--term.nhistview - i) * sizeof(*term.histview));
+		break;
+	}
+	free(b->data);
+	*b = (HistBlock){ 0 };
+}
+
+/* open histfile; returns 0 and turns histspill off if that fails */
+int
+spillopen(void)
+{
+	char path[PATH_MAX];
+	const char *dir;
+
+	if (!(dir = getenv("TMPDIR")) || !*dir)
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/st-histXXXXXX", dir);
+	if ((histfile.fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "histspill: %s: %s\n", path, strerror(errno));
+		histspill = 0;
+		return 0;
+	}
+	unlink(path);
+	return 1;
+}
+
+/*
+ * Cut the dropped blocks off the start of histfile once they take half of
+ * it. Blocks are spilled in order and dropped oldest first, so the ones
+ * in use are all at the end.
+ */
+void
+spillcompact(void)
+{
+	uchar buf[1 << 16];
+	size_t dead = histfile.len, pos;
+	ssize_t n;
+
+	if (term.blk0 < term.blk1 && !HISTBLK(term.blk0).data)
+		dead = HISTBLK(term.blk0).off - histfile.base;
+	if (dead < (1 << 20) || dead < histfile.len / 2)
+		return;
+	/* the blocks are copied over the dropped half only, so it can stop */
+	for (pos = dead; pos < histfile.len; pos += n) {
+		if ((n = pread(histfile.fd, buf, MIN(sizeof(buf),
+		               histfile.len - pos), pos)) <= 0 ||
+		    pwrite(histfile.fd, buf, n, pos - dead) != n) {
+			fprintf(stderr, "histspill: %s\n", strerror(errno));
+			return;
+		}
+	}
+	if (ftruncate(histfile.fd, histfile.len - dead) < 0)
+		fprintf(stderr, "histspill: %s\n", strerror(errno));
+	histfile.base += dead;
+	histfile.len -= dead;
+	if (histfile.map)
+		munmap(histfile.map, histfile.siz);
+	histfile.map = NULL;
+	histfile.siz = 0;
+}
+
+/* the packed lines of b, mapping histfile again if it grew past the map */
+uchar *
+spilldata(HistBlock *b)
+{
+	size_t off;
+
+	if (b->data)
+		return b->data;
+	off = b->off - histfile.base;
+	if (off + b->len > histfile.siz) {
+		if (histfile.map)
+			munmap(histfile.map, histfile.siz);
+		histfile.map = mmap(NULL, histfile.len, PROT_READ, MAP_SHARED,
+		                    histfile.fd, 0);
+		if (histfile.map == MAP_FAILED)
+			die("histspill: mmap: %s\n", strerror(errno));
+		histfile.siz = histfile.len;
+	}
+	return histfile.map + off;
+}
+
+/* move the data of block b, just packed, to histfile */
+int
+spillblock(HistBlock *b)
+{
+	if (histfile.fd < 0 && !spillopen())
+		return 0;
+	spillcompact();
+	if (pwrite(histfile.fd, b->data, b->len, histfile.len) !=
+	    (ssize_t)b->len) {
+		fprintf(stderr, "histspill: %s\n", strerror(errno));
+		histspill = 0;
+		return 0;
+	}
+	free(b->data);
+	b->data = NULL;
+	b->off = histfile.base + histfile.len;
+	histfile.len += b->len;
+	return 1;
+}
+
+void
+lzputlen(uchar **p, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*(*p)++ = 255;
+	*(*p)++ = n;
+}
+
+uchar *
+lzputseq(uchar *p, const uchar *lit, size_t nlit, size_t off, size_t m)
+{
+	*p++ = MIN(nlit, 15) << 4 | (m ? MIN(m - 4, 15) : 0);
+	if (nlit >= 15)
+		lzputlen(&p, nlit - 15);
+	memcpy(p, lit, nlit);
+	p += nlit;
+	if (!m)
+		return p;
+	*p++ = off;
+	*p++ = off >> 8;
+	if (m - 4 >= 15)
+		lzputlen(&p, m - 4 - 15);
+	return p;
+}
+
+/*
+ * Compress the n bytes of src to dst, which has room for n + n / 255 + 16,
+ * in the format of LZ4 blocks: sequences of a token, literals and a match
+ * 4 bytes long at least and up to 64k back. Returns the bytes written.
+ */
+size_t
+lzpack(const uchar *src, size_t n, uchar *dst)
+{
+	uint32_t tab[LZ_HASH] = { 0 }, w, c, h;
+	size_t i = 0, lit = 0, m, cand, miss = 0;
+	uchar *p = dst;
+
+	/* step faster through data that does not compress */
+	while (i + 4 <= n) {
+		memcpy(&w, src + i, 4);
+		h = (w * 2654435761U) >> 20;
+		cand = tab[h];
+		tab[h] = i + 1;
+		if (cand && i + 1 - cand <= 0xffff) {
+			memcpy(&c, src + --cand, 4);
+			if (w == c) {
+				for (m = 4; i + m < n && src[cand+m] == src[i+m]; m++)
+					;
+				p = lzputseq(p, src + lit, i - lit, i - cand, m);
+				i += m;
+				lit = i;
+				miss = 0;
+				continue;
+			}
+		}
+		i += 1 + (miss++ >> 5);
+	}
+	return lzputseq(p, src + lit, n - lit, 0, 0) - dst;
+}
+
+size_t
+lzgetlen(const uchar **p, size_t n)
+{
+	if (n == 15) {
+		do
+			n += **p;
+		while (*(*p)++ == 255);
+	}
+	return n;
+}
+
+/* uncompress the n bytes at src made by lzpack() to dst; returns its length */
+size_t
+lzunpack(const uchar *src, size_t n, uchar *dst, size_t siz)
+{
+	const uchar *end = src + n;
+	uchar *p = dst;
+	size_t nlit, m, off;
+	uchar tok;
+
+	while (src < end) {
+		tok = *src++;
+		nlit = lzgetlen(&src, tok >> 4);
+		if (nlit > siz - (p - dst))
+			break;
+		memcpy(p, src, nlit);
+		p += nlit;
+		src += nlit;
+		if (src >= end)
+			break;
+		off = src[0] | src[1] << 8;
+		src += 2;
+		m = lzgetlen(&src, tok & 15) + 4;
+		if (off > (size_t)(p - dst) || m > siz - (p - dst))
+			break;
+		for (; m; m--, p++)
+			*p = *(p - off);
+	}
+	return p - dst;
+}
+
+/*
+ * A line of term.slabcol cells. The lines are kept in slabs, blocks of
+ * lines of the same size, and a new slab of LINE_CHUNK lines is added
+ * when all are in use.
+ */
+Line
+linealloc(void)
+{
+	size_t size = LINESIZE(term.slabcol);
+	char *slab;
+	int i;
+
+	if (!term.nfree) {
+		slab = xmalloc(LINE_CHUNK * size);
+		term.slab = xrealloc(term.slab,
+		                     (term.nslab + 1) * sizeof(*term.slab));
+		term.slab[term.nslab++] = slab;
+		term.nline += LINE_CHUNK;
+		term.freeline = xrealloc(term.freeline,
+		                         term.nline * sizeof(*term.freeline));
+		for (i = LINE_CHUNK; i-- > 0; )
+			term.freeline[term.nfree++] = (Line)(slab + i * size);
+	}
+	return term.freeline[--term.nfree];
+}
+
+/*
+ * Move the lines in use, nscr rows of both screens, to a single new slab
+ * of lines of col cells and free the others.
+ */
+void
+slabpack(int col, int nscr)
+{
+	Line *lines[] = { term.line, term.alt };
+	int nlines[] = { nscr, nscr };
+	size_t size = LINESIZE(col);
+	char *slab;
+	int i, j, n;
+
+	for (i = n = 0; i < LEN(lines); i++) {
+		for (j = 0; lines[i] && j < nlines[i]; j++)
+			n += lines[i][j] != NULL;
+	}
+	slab = n ? xmalloc(n * size) : NULL;
+	for (i = n = 0; i < LEN(lines); i++) {
+		for (j = 0; lines[i] && j < nlines[i]; j++) {
+			if (lines[i][j]) {
+				lines[i][j] = linecopy((Line)(slab + n++ * size),
+				                       lines[i][j]);
+			}
+		}
+	}
+
+	for (i = 0; i < term.nslab; i++)
+		free(term.slab[i]);
+	term.nslab = 0;
+	if (slab) {
+		term.slab = xrealloc(term.slab, sizeof(*term.slab));
+		term.slab[term.nslab++] = slab;
+	}
+	term.slabcol = col;
+	term.nline = n;
+	term.nfree = 0;
+}
+
+/* turn the dummy at x, left from an overwritten wide char, into a blank */
+void
+lineundummy(Line l, int x)
+{
+	Glyph g = tglyph(l, x);
+
+	l->cell[x] = CELL(' ', g.mode & ~ATTR_WDUMMY);
+	if (g.mode & ATTR_WDUMMY) {
+		g.mode = 0;
+		linesetattr(l, x, x+1, tattrid(&g));
+	}
+}
+
+ushort
+linemode(Line l, int x)
+{
+	return attrtab.set[l->run[linerun(l, x)].attr].mode |
+	       CELLMODE(l->cell[x]);
+}
+
+Glyph
+tglyph(Line l, int x)
+{
+	Glyph g = attrtab.set[l->run[linerun(l, x)].attr];
+
+	g.u = CELLRUNE(l->cell[x]);
+	g.mode |= CELLMODE(l->cell[x]);
+	return g;
+}
+
+/* unpack the columns x1 to x2-1 of l into buf */
+void
+tglyphs(Line l, int x1, int x2, Glyph *buf)
+{
+	int r, end, x;
+
+	for (r = linerun(l, x1), x = x1; x < x2; r++) {
+		end = r + 1 < l->nrun ? MIN(l->run[r+1].x, x2) : x2;
+		for (; x < end; x++, buf++) {
+			*buf = attrtab.set[l->run[r].attr];
+			buf->u = CELLRUNE(l->cell[x]);
+			buf->mode |= CELLMODE(l->cell[x]);
+		}
+	}
+}
+
+/* the column where the attribute run of l holding x ends */
+int
+tattrrun(Line l, int x)
+{
+	int r = linerun(l, x);
+
+	return r + 1 < l->nrun ? l->run[r+1].x : INT_MAX;
+}
+
+int
+tattrset(int attr)
+{
+	int i, r;
+	Line l;
+
+	for (i = 0; i < term.row-1; i++) {
+		l = term.line[i];
+		for (r = 0; r < l->nrun && l->run[r].x < term.col-1; r++) {
+			if (attrtab.set[l->run[r].attr].mode & attr)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the ms left before drawing resumes while an application updates
+ * the screen in synchronized mode, or 0. Gives up on the update after
+ * timeout ms.
+ */
+int
+tinsync(unsigned int timeout)
+{
+	struct timespec now;
+	int left;
+
+	if (!IS_SET(MODE_SYNC))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((left = timeout - TIMEDIFF(now, synctime)) > 0)
+		return left;
+	term.mode &= ~MODE_SYNC;
+
+	return 0;
+}
+
+/* a synchronized update ended and its frame should be drawn right away */
+int
+tsyncdone(void)
+{
+	return syncdone;
+}
+
+void
+tsetdirt(int top, int bot)
+{
+	int i;
+
+	LIMIT(top, 0, term.row-1);
+	LIMIT(bot, 0, term.row-1);
+
+	for (i = top; i <= bot; i++)
+		term.dirty[i] = (Dirty){ 0, term.maxcol };
+}
+
+void
+tsetdirtx(int y, int x1, int x2)
+{
+	Dirty *d = &term.dirty[y];
+
+	LIMIT(x1, 0, term.maxcol);
+	LIMIT(x2, 0, term.maxcol);
+	if (x1 >= x2)
+		return;
+	if (d->x1 >= d->x2) {
+		d->x1 = x1;
+		d->x2 = x2;
+	} else {
+		d->x1 = MIN(d->x1, x1);
+		d->x2 = MAX(d->x2, x2);
+	}
+}
+
+void
+tsetdirtattr(int attr)
+{
+	int i, r;
+	Line l;
+
+	for (i = 0; i < term.row-1; i++) {
+		l = term.line[i];
+		for (r = 0; r < l->nrun && l->run[r].x < term.col-1; r++) {
+			if (attrtab.set[l->run[r].attr].mode & attr) {
+				tsetdirt(i, i);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Note that lines top to bot scroll up by n, down if n is negative: their
+ * damage moves with them and only the lines scrolled in are dirty. draw()
+ * moves what is already drawn of the others.
+ */
+void
+tsetdirtscroll(int top, int bot, int n)
+{
+	Scroll *s = term.nscroll ? &term.scroll[term.nscroll - 1] : NULL;
+	int h = bot - top + 1, m = abs(n);
+
+	if (s && s->top == top && s->bot == bot && (s->n < 0) == (n < 0)) {
+		s->n += n;
+	} else if (term.scr == 0 && term.nscroll < SCROLL_MAX && m < h) {
+		s = &term.scroll[term.nscroll++];
+		*s = (Scroll){ top, bot, n };
+	} else {
+		tsetdirt(top, bot);
+		return;
+	}
+	if (abs(s->n) >= h) {
+		term.nscroll--;
+		tsetdirt(top, bot);
+		return;
+	}
+
+	if (n > 0) {
+		memmove(&term.dirty[top], &term.dirty[top + m],
+		        (h - m) * sizeof(*term.dirty));
+		tsetdirt(bot - m + 1, bot);
+	} else {
+		memmove(&term.dirty[top + m], &term.dirty[top],
+		        (h - m) * sizeof(*term.dirty));
+		tsetdirt(top, top + m - 1);
+	}
+	/* the old cursor moves too, draw() erases it */
+	if (BETWEEN(term.ocy, top, bot))
+		term.ocy -= n;
+}
+
+void
+tfulldirt(void)
+{
+	term.nscroll = 0;
+	tsetdirt(0, term.row-1);
+}
+
+void
+tcursor(int mode)
+{
+	static TCursor c[2];
+	int alt = IS_SET(MODE_ALTSCREEN);
+
+	if (mode == CURSOR_SAVE) {
+		c[alt] = term.c;
+	} else if (mode == CURSOR_LOAD) {
+		term.c = c[alt];
+		tmoveto(c[alt].x, c[alt].y);
+	}
+}
+
+void
+treset(void)
+{
+	uint i;
+
+	term.c = (TCursor){{
+		.mode = ATTR_NULL,
+		.fg = defaultfg,
+		.bg = defaultbg
+	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
 	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
 	for (i = tabspaces; i < term.col; i += tabspaces)
@@ -1055,6 +2834,9 @@ treset(void)
 	memset(term.trantbl, CS_USA, sizeof(term.trantbl));
 	term.charset = 0;
 
+	term.scr = 0;
+	histclear();
+
 	for (i = 0; i < 2; i++) {
 		tmoveto(0, 0);
 		tcursor(CURSOR_SAVE);
@@ -1063,6 +2845,33 @@ treset(void)
 	}
 }
 
+/* drop the history and give its memory back */
+void
+histclear(void)
+{
+	long n;
+
+	for (n = term.hist0; n < term.histhi; n++)
+		histlinefree(HISTLINE(n));
+	for (n = term.blk0; n < term.blk1; n++)
+		histfree(n);
+	free(term.hist);
+	free(term.histblk);
+	term.hist = NULL;
+	term.histblk = NULL;
+	term.histcap = term.blkcap = 0;
+	term.histlo = term.histhi = term.hist0 = 0;
+	term.blk0 = term.blk1 = 0;
+
+	/* give the disk space back too */
+	if (histfile.map)
+		munmap(histfile.map, histfile.siz);
+	if (histfile.fd >= 0 && ftruncate(histfile.fd, 0) < 0)
+		fprintf(stderr, "histspill: %s\n", strerror(errno));
+	histfile.map = NULL;
+	histfile.siz = histfile.base = histfile.len = 0;
+}
+
 void
 tnew(int col, int row)
 {
@@ -1074,10 +2883,12 @@ tnew(int col, int row)
 void
 tswapscreen(void)
 {
-	Line *tmp = term.line;
+	Line *tmp = term.line, *buf = term.linebuf;
 
 	term.line = term.alt;
 	term.alt = tmp;
+	term.linebuf = term.altbuf;
+	term.altbuf = buf;
 	term.mode ^= MODE_ALTSCREEN;
 	tfulldirt();
 }
@@ -1108,7 +2919,9 @@ kscrollup(const Arg* a)
 	if (n < 0)
 		n = term.row + n;
 
-	if (term.scr <= HISTSIZE-n) {
+	/* up to the oldest line scrolled into the history */
+	n = MIN(n, HISTN() - term.scr);
+	if (n > 0) {
 		term.scr += n;
 		selscroll(0, n);
 		tfulldirt();
@@ -1119,24 +2932,29 @@ void
 tscrolldown(int orig, int n, int copyhist)
 {
 	int i;
-	Line temp;
+	Line temp, l;
+	Glyph g = { .fg = defaultfg, .bg = defaultbg };
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	if (copyhist) {
-		term.histi = (term.histi - 1 + HISTSIZE) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[term.bot];
-		term.line[term.bot] = temp;
+	/* the line scrolled off takes the place of the newest one */
+	if (copyhist && term.histhi > term.hist0) {
+		l = histlinecopy(term.line[term.bot], tattrid(&g));
+		histlinefree(HISTLINE(term.histhi - 1));
+		HISTLINE(term.histhi - 1) = l;
 	}
 
-	tsetdirt(orig, term.bot-n);
 	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	tsetdirtscroll(orig, term.bot, -n);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	if (orig == 0 && term.bot == term.row-1 && n < term.row) {
+		tslide(-n);
+	} else {
+		for (i = term.bot; i >= orig+n; i--) {
+			temp = term.line[i];
+			term.line[i] = term.line[i-n];
+			term.line[i-n] = temp;
+		}
 	}
 
 	if (term.scr == 0)
@@ -1148,32 +2966,65 @@ tscrollup(int orig, int n, int copyhist)
 {
 	int i;
 	Line temp;
+	Glyph g = { .fg = defaultfg, .bg = defaultbg };
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	if (copyhist) {
-		term.histi = (term.histi + 1) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[orig];
-		term.line[orig] = temp;
-	}
+	if (copyhist && histsize)
+		histpush(histlinecopy(term.line[orig], tattrid(&g)));
 
-	if (term.scr > 0 && term.scr < HISTSIZE)
-		term.scr = MIN(term.scr + n, HISTSIZE-1);
+	/* the view stays on its lines, but not past the oldest one */
+	if (term.scr > 0 && term.scr < (int)histsize)
+		term.scr = MIN(term.scr + n, MIN(HISTN(), (int)histsize-1));
 
 	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	tsetdirtscroll(orig, term.bot, n);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	if (orig == 0 && term.bot == term.row-1 && n < term.row) {
+		tslide(n);
+	} else {
+		for (i = orig; i <= term.bot-n; i++) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+n];
+			term.line[i+n] = temp;
+		}
 	}
 
 	if (term.scr == 0)
 		selscroll(orig, -n);
 }
 
+/*
+ * Scroll the whole screen up by n lines, down if n is negative, by moving
+ * its window over term.linebuf. The lines scrolled out come in at the
+ * other end; the window is moved back to the far end of the buffer when
+ * it runs into this one.
+ */
+void
+tslide(int n)
+{
+	int cap = LINE_SLACK * term.row;
+	int off = term.line - term.linebuf;
+
+	if (n > 0) {
+		if (off + term.row + n > cap) {
+			memmove(term.linebuf, term.line, term.row * sizeof(Line));
+			off = 0;
+		}
+		memcpy(&term.linebuf[off + term.row], &term.linebuf[off],
+		       n * sizeof(Line));
+	} else {
+		if (off + n < 0) {
+			memmove(&term.linebuf[cap - term.row], term.line,
+			        term.row * sizeof(Line));
+			off = cap - term.row;
+		}
+		memcpy(&term.linebuf[off + n], &term.linebuf[off + term.row + n],
+		       -n * sizeof(Line));
+	}
+	term.line = &term.linebuf[off + n];
+}
+
 void
 selscroll(int orig, int n)
 {
@@ -1207,34 +3058,47 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void
-csiparse(void)
+/*
+ * Parse the next character of a CSI sequence as it arrives, returns 1
+ * once the sequence is complete
+ */
+int
+csiparse(Rune u)
 {
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	if (*p == '?') {
+	int *v;
+
+	csiescseq.buf[csiescseq.len++] = u;
+
+	if (BETWEEN(u, '0', '9') && csiescseq.state == CSI_PARAM) {
+		v = &csiescseq.arg[csiescseq.narg];
+		if (*v != -1)
+			*v = (*v > (INT_MAX - (int)(u - '0')) / 10) ?
+			     -1 : *v * 10 + (u - '0');
+	} else if (u == ';' && csiescseq.state == CSI_PARAM) {
+		if (csiescseq.narg + 1 == ESC_ARG_SIZ)
+			csiescseq.state = CSI_IGNORE;
+		else
+			csiescseq.narg++;
+	} else if (u == '?' && csiescseq.len == 1) {
 		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
+	} else if (BETWEEN(u, 0x20, 0x2F) &&
+	           csiescseq.state != CSI_IGNORE) {
+		/* only a single intermediate byte is supported */
+		csiescseq.state = csiescseq.inter ? CSI_IGNORE : CSI_INTER;
+		csiescseq.inter = u;
+	} else if (BETWEEN(u, 0x40, 0x7E)) {
+		csiescseq.final = u;
+		csiescseq.narg++;
+		return 1;
+	} else {
+		csiescseq.state = CSI_IGNORE;
+	}
+
+	if (csiescseq.len >= sizeof(csiescseq.buf)-1) {
+		csiescseq.state = CSI_IGNORE;
+		return 1;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
+	return 0;
 }
 
 /* for absolute user moves, when decom is set */
@@ -1274,6 +3138,7 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
+	Cell *cell;
 
 	/*
 	 * The table is proudly stolen from rxvt.
@@ -1282,29 +3147,31 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
 		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
-	if (term.line[y][x].mode & ATTR_WIDE) {
+	cell = term.line[y]->cell;
+	if (cell[x] & CELL_WIDE) {
 		if (x+1 < term.col) {
-			term.line[y][x+1].u = ' ';
-			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+			lineundummy(term.line[y], x+1);
+			tsetdirtx(y, x+1, x+2);
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x-1].u = ' ';
-		term.line[y][x-1].mode &= ~ATTR_WIDE;
+	} else if (cell[x] & CELL_WDUMMY) {
+		cell[x-1] = CELL(' ', CELLMODE(cell[x-1]) & ~ATTR_WIDE);
+		tsetdirtx(y, x-1, x);
 	}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	term.line[y][x].u = u;
+	tsetdirtx(y, x, x+1);
+	cell[x] = CELL(u, attr->mode);
+	linesetattr(term.line[y], x, x+1, tattrid(attr));
 
 	if (isboxdraw(u))
-		term.line[y][x].mode |= ATTR_BOXDRAW;
+		cell[x] |= CELL(0, ATTR_BOXDRAW);
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	Glyph g = { .fg = term.c.attr.fg, .bg = term.c.attr.bg };
+	int x, y, temp, sx1, sx2;
+	uint a;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1316,17 +3183,14 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y1, 0, term.row-1);
 	LIMIT(y2, 0, term.row-1);
 
+	a = tattrid(&g);
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
-		}
+		tsetdirtx(y, x1, x2+1);
+		if (selectedcols(y, &sx1, &sx2) && MAX(x1, sx1) <= MIN(x2, sx2))
+			selclear();
+		for (x = x1; x <= x2; x++)
+			term.line[y]->cell[x] = ' ';
+		linesetattr(term.line[y], x1, x2+1, a);
 	}
 }
 
@@ -1334,16 +3198,14 @@ void
 tdeletechar(int n)
 {
 	int dst, src, size;
-	Glyph *line;
 
 	LIMIT(n, 0, term.col - term.c.x);
 
 	dst = term.c.x;
 	src = term.c.x + n;
 	size = term.col - src;
-	line = term.line[term.c.y];
-
-	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	linemove(term.line[term.c.y], dst, src, size);
+	tsetdirtx(term.c.y, dst, term.col);
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
 }
 
@@ -1351,16 +3213,14 @@ void
 tinsertblank(int n)
 {
 	int dst, src, size;
-	Glyph *line;
 
 	LIMIT(n, 0, term.col - term.c.x);
 
 	dst = term.c.x + n;
 	src = term.c.x;
 	size = term.col - dst;
-	line = term.line[term.c.y];
-
-	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	linemove(term.line[term.c.y], dst, src, size);
+	tsetdirtx(term.c.y, src, term.col);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1634,6 +3494,13 @@ tsetmode(int priv, int set, const int *args, int narg)
 			case 2004: /* 2004: bracketed paste mode */
 				xsetmode(set, MODE_BRCKTPASTE);
 				break;
+			case 2026: /* 2026: synchronized update */
+				if (set)
+					clock_gettime(CLOCK_MONOTONIC, &synctime);
+				else if (IS_SET(MODE_SYNC))
+					syncdone = 1;
+				MODBIT(term.mode, set, MODE_SYNC);
+				break;
 			/* Not implemented mouse modes. See comments there. */
 			case 1001: /* mouse highlight mode; can hang the
 				      terminal by design when implemented. */
@@ -1676,215 +3543,349 @@ tsetmode(int priv, int set, const int *args, int narg)
 	}
 }
 
-void
-csihandle(void)
+int
+csiich(void) /* ICH -- Insert <n> blank char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblank(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicuu(void) /* CUU -- Cursor <n> Up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicud(void) /* CUD, VPR -- Cursor <n> Down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csimc(void) /* MC -- Media Copy */
+{
+	switch (csiescseq.arg[0]) {
+	case 0:
+		tdump();
+		break;
+	case 1:
+		tdumpline(term.c.y);
+		break;
+	case 2:
+		tdumpsel();
+		break;
+	case 4:
+		term.mode &= ~MODE_PRINT;
+		break;
+	case 5:
+		term.mode |= MODE_PRINT;
+		break;
+	}
+	return 0;
+}
+
+int
+csida(void) /* DA -- Device Attributes */
+{
+	if (csiescseq.arg[0] == 0)
+		ttywrite(vtiden, strlen(vtiden), 0);
+	return 0;
+}
+
+int
+csirep(void) /* REP -- if last char is printable print it <n> more times */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	if (term.lastc)
+		while (csiescseq.arg[0]-- > 0)
+			tputc(term.lastc);
+	return 0;
+}
+
+int
+csicuf(void) /* CUF, HPR -- Cursor <n> Forward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicub(void) /* CUB -- Cursor <n> Backward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicnl(void) /* CNL -- Cursor <n> Down and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y+csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicpl(void) /* CPL -- Cursor <n> Up and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csitbc(void) /* TBC -- Tabulation clear */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* clear current tab stop */
+		term.tabs[term.c.x] = 0;
+		break;
+	case 3: /* clear all the tabs */
+		memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+int
+csicha(void) /* CHA, HPA -- Move to <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(csiescseq.arg[0]-1, term.c.y);
+	return 0;
+}
+
+int
+csicup(void) /* CUP, HVP -- Move to <row> <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], 1);
+	tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
+	return 0;
+}
+
+int
+csicht(void) /* CHT -- Cursor Forward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csied(void) /* ED -- Clear screen */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* below */
+		tclearregion(term.c.x, term.c.y, term.col-1, term.c.y);
+		if (term.c.y < term.row-1) {
+			tclearregion(0, term.c.y+1, term.col-1,
+					term.row-1);
+		}
+		break;
+	case 1: /* above */
+		if (term.c.y > 1)
+			tclearregion(0, 0, term.col-1, term.c.y-1);
+		tclearregion(0, term.c.y, term.c.x, term.c.y);
+		break;
+	case 2: /* all */
+		tclearregion(0, 0, term.col-1, term.row-1);
+		break;
+	case 3: /* scrollback */
+		kscrolldown(&(Arg){ .i = term.scr });
+		histclear();
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+int
+csiel(void) /* EL -- Clear line */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* right */
+		tclearregion(term.c.x, term.c.y, term.col-1,
+				term.c.y);
+		break;
+	case 1: /* left */
+		tclearregion(0, term.c.y, term.c.x, term.c.y);
+		break;
+	case 2: /* all */
+		tclearregion(0, term.c.y, term.col-1, term.c.y);
+		break;
+	}
+	return 0;
+}
+
+int
+csisu(void) /* SU -- Scroll <n> line up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrollup(term.top, csiescseq.arg[0], 0);
+	return 0;
+}
+
+int
+csisd(void) /* SD -- Scroll <n> line down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrolldown(term.top, csiescseq.arg[0], 0);
+	return 0;
+}
+
+int
+csiil(void) /* IL -- Insert <n> blank lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblankline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csirm(void) /* RM -- Reset Mode */
+{
+	tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csidl(void) /* DL -- Delete <n> lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeleteline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csiech(void) /* ECH -- Erase <n> char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tclearregion(term.c.x, term.c.y,
+			term.c.x + csiescseq.arg[0] - 1, term.c.y);
+	return 0;
+}
+
+int
+csidch(void) /* DCH -- Delete <n> char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeletechar(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicbt(void) /* CBT -- Cursor Backward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csivpa(void) /* VPA -- Move to <row> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveato(term.c.x, csiescseq.arg[0]-1);
+	return 0;
+}
+
+int
+csism(void) /* SM -- Set terminal mode */
+{
+	tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csisgr(void) /* SGR -- Terminal attribute (color) */
+{
+	tsetattr(csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csidsr(void) /* DSR -- Device Status Report (cursor position) */
+{
+	char buf[40];
+	int len;
+
+	if (csiescseq.arg[0] == 6) {
+		len = snprintf(buf, sizeof(buf), "\033[%i;%iR",
+				term.c.y+1, term.c.x+1);
+		ttywrite(buf, len, 0);
+	}
+	return 0;
+}
+
+int
+csidecstbm(void) /* DECSTBM -- Set Scrolling Region */
+{
+	if (csiescseq.priv)
+		return -1;
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], term.row);
+	tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
+	tmoveato(0, 0);
+	return 0;
+}
+
+int
+csidecsc(void) /* DECSC -- Save cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_SAVE);
+	return 0;
+}
+
+int
+csidecrc(void) /* DECRC -- Restore cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_LOAD);
+	return 0;
+}
+
+int
+csidecscusr(void) /* DECSCUSR -- Set Cursor Style */
+{
+	return xsetcursor(csiescseq.arg[0]) ? -1 : 0;
+}
+
+int
+csidecrqm(void) /* DECRQM -- Request Mode, only for synchronized updates */
 {
 	char buf[40];
 	int len;
 
-	switch (csiescseq.mode[0]) {
-	default:
-	unknown:
+	if (!csiescseq.priv || csiescseq.arg[0] != 2026)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "\033[?2026;%d$y",
+	               IS_SET(MODE_SYNC) ? 1 : 2);
+	ttywrite(buf, len, 0);
+	return 0;
+}
+
+void
+csihandle(void)
+{
+	int (*handler)(void) = NULL;
+
+	if (csiescseq.state != CSI_IGNORE)
+		handler = csihandler[CSIINTER(csiescseq.inter)]
+		                    [csiescseq.final - '@'];
+	if (!handler || handler() < 0) {
 		fprintf(stderr, "erresc: unknown csi ");
 		csidump();
 		/* die(""); */
-		break;
-	case '@': /* ICH -- Insert <n> blank char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblank(csiescseq.arg[0]);
-		break;
-	case 'A': /* CUU -- Cursor <n> Up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
-		break;
-	case 'B': /* CUD -- Cursor <n> Down */
-	case 'e': /* VPR --Cursor <n> Down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
-		break;
-	case 'i': /* MC -- Media Copy */
-		switch (csiescseq.arg[0]) {
-		case 0:
-			tdump();
-			break;
-		case 1:
-			tdumpline(term.c.y);
-			break;
-		case 2:
-			tdumpsel();
-			break;
-		case 4:
-			term.mode &= ~MODE_PRINT;
-			break;
-		case 5:
-			term.mode |= MODE_PRINT;
-			break;
-		}
-		break;
-	case 'c': /* DA -- Device Attributes */
-		if (csiescseq.arg[0] == 0)
-			ttywrite(vtiden, strlen(vtiden), 0);
-		break;
-	case 'b': /* REP -- if last char is printable print it <n> more times */
-		DEFAULT(csiescseq.arg[0], 1);
-		if (term.lastc)
-			while (csiescseq.arg[0]-- > 0)
-				tputc(term.lastc);
-		break;
-	case 'C': /* CUF -- Cursor <n> Forward */
-	case 'a': /* HPR -- Cursor <n> Forward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
-		break;
-	case 'D': /* CUB -- Cursor <n> Backward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
-		break;
-	case 'E': /* CNL -- Cursor <n> Down and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y+csiescseq.arg[0]);
-		break;
-	case 'F': /* CPL -- Cursor <n> Up and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y-csiescseq.arg[0]);
-		break;
-	case 'g': /* TBC -- Tabulation clear */
-		switch (csiescseq.arg[0]) {
-		case 0: /* clear current tab stop */
-			term.tabs[term.c.x] = 0;
-			break;
-		case 3: /* clear all the tabs */
-			memset(term.tabs, 0, term.col * sizeof(*term.tabs));
-			break;
-		default:
-			goto unknown;
-		}
-		break;
-	case 'G': /* CHA -- Move to <col> */
-	case '`': /* HPA */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(csiescseq.arg[0]-1, term.c.y);
-		break;
-	case 'H': /* CUP -- Move to <row> <col> */
-	case 'f': /* HVP */
-		DEFAULT(csiescseq.arg[0], 1);
-		DEFAULT(csiescseq.arg[1], 1);
-		tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
-		break;
-	case 'I': /* CHT -- Cursor Forward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(csiescseq.arg[0]);
-		break;
-	case 'J': /* ED -- Clear screen */
-		switch (csiescseq.arg[0]) {
-		case 0: /* below */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y);
-			if (term.c.y < term.row-1) {
-				tclearregion(0, term.c.y+1, term.col-1,
-						term.row-1);
-			}
-			break;
-		case 1: /* above */
-			if (term.c.y > 1)
-				tclearregion(0, 0, term.col-1, term.c.y-1);
-			tclearregion(0, term.c.y, term.c.x, term.c.y);
-			break;
-		case 2: /* all */
-			tclearregion(0, 0, term.col-1, term.row-1);
-			break;
-		default:
-			goto unknown;
-		}
-		break;
-	case 'K': /* EL -- Clear line */
-		switch (csiescseq.arg[0]) {
-		case 0: /* right */
-			tclearregion(term.c.x, term.c.y, term.col-1,
-					term.c.y);
-			break;
-		case 1: /* left */
-			tclearregion(0, term.c.y, term.c.x, term.c.y);
-			break;
-		case 2: /* all */
-			tclearregion(0, term.c.y, term.col-1, term.c.y);
-			break;
-		}
-		break;
-	case 'S': /* SU -- Scroll <n> line up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrollup(term.top, csiescseq.arg[0], 0);
-		break;
-	case 'T': /* SD -- Scroll <n> line down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0], 0);
-		break;
-	case 'L': /* IL -- Insert <n> blank lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblankline(csiescseq.arg[0]);
-		break;
-	case 'l': /* RM -- Reset Mode */
-		tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
-		break;
-	case 'M': /* DL -- Delete <n> lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeleteline(csiescseq.arg[0]);
-		break;
-	case 'X': /* ECH -- Erase <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tclearregion(term.c.x, term.c.y,
-				term.c.x + csiescseq.arg[0] - 1, term.c.y);
-		break;
-	case 'P': /* DCH -- Delete <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeletechar(csiescseq.arg[0]);
-		break;
-	case 'Z': /* CBT -- Cursor Backward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(-csiescseq.arg[0]);
-		break;
-	case 'd': /* VPA -- Move to <row> */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveato(term.c.x, csiescseq.arg[0]-1);
-		break;
-	case 'h': /* SM -- Set terminal mode */
-		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
-		break;
-	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(csiescseq.arg, csiescseq.narg);
-		break;
-	case 'n': /* DSR – Device Status Report (cursor position) */
-		if (csiescseq.arg[0] == 6) {
-			len = snprintf(buf, sizeof(buf), "\033[%i;%iR",
-					term.c.y+1, term.c.x+1);
-			ttywrite(buf, len, 0);
-		}
-		break;
-	case 'r': /* DECSTBM -- Set Scrolling Region */
-		if (csiescseq.priv) {
-			goto unknown;
-		} else {
-			DEFAULT(csiescseq.arg[0], 1);
-			DEFAULT(csiescseq.arg[1], term.row);
-			tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
-			tmoveato(0, 0);
-		}
-		break;
-	case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
-		tcursor(CURSOR_SAVE);
-		break;
-	case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
-		tcursor(CURSOR_LOAD);
-		break;
-	case ' ':
-		switch (csiescseq.mode[1]) {
-		case 'q': /* DECSCUSR -- Set Cursor Style */
-			if (xsetcursor(csiescseq.arg[0]))
-				goto unknown;
-			break;
-		default:
-			goto unknown;
-		}
-		break;
 	}
 }
 
@@ -1946,7 +3947,7 @@ osc_color_response(int num, int index, int is_osc4)
 void
 strhandle(void)
 {
-	char *p = NULL, *dec;
+	char *p = NULL, *d;
 	int j, narg, par;
 	const struct { int idx; char *str; } osc_table[] = {
 		{ defaultfg, "foreground" },
@@ -1955,6 +3956,10 @@ strhandle(void)
 	};
 
 	term.esc &= ~(ESC_STR_END|ESC_STR);
+	if (strescseq.state == STR_LONG) {
+		fprintf(stderr, "erresc: str longer than maxstrsiz ignored\n");
+		return;
+	}
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1976,15 +3981,20 @@ strhandle(void)
 				xsettitle(strescseq.args[1]);
 			return;
 		case 52:
-			if (narg > 2 && allowwindowops) {
-				dec = base64dec(strescseq.args[2]);
-				if (dec) {
-					xsetsel(dec);
-					xclipcopy();
-				} else {
-					fprintf(stderr, "erresc: invalid base64\n");
-				}
+			if (strescseq.state != STR_SEL)
+				return;
+			/* emulate padding if the payload ends mid quad */
+			if (strescseq.nquad > 0) {
+				while (strescseq.nquad < 4)
+					strescseq.quad[strescseq.nquad++] = -1;
+				d = strescseq.dec + strescseq.declen;
+				base64quad(strescseq.quad, &d);
+				strescseq.declen = d - strescseq.dec;
 			}
+			strescseq.dec[strescseq.declen] = '\0';
+			xsetsel(strescseq.dec);
+			strescseq.dec = NULL;
+			xclipcopy();
 			return;
 		case 10:
 		case 11:
@@ -2070,7 +4080,7 @@ externalpipe(const Arg *arg)
 	int to[2];
 	char buf[UTF_SIZ];
 	void (*oldsigpipe)(int);
-	Glyph *bp, *end;
+	const Cell *bp, *end;
 	int lastpos, n, newline;
 
 	if (pipe(to) == -1)
@@ -2095,8 +4105,8 @@ externalpipe(const Arg *arg)
 	/* ignore sigpipe for now, in case child exists early */
 	oldsigpipe = signal(SIGPIPE, SIG_IGN);
 	newline = 0;
-	for (n = 0; n <= HISTSIZE + 2; n++) {
-		bp = TLINE_HIST(n);
+	for (n = 0; n < HISTN() + term.row; n++) {
+		bp = TLINE_HIST(n)->cell;
 		lastpos = MIN(tlinehistlen(n) + 1, term.col) - 1;
 		if (lastpos < 0)
 			break;
@@ -2104,9 +4114,9 @@ externalpipe(const Arg *arg)
 			continue;
 		end = &bp[lastpos + 1];
 		for (; bp < end; ++bp)
-			if (xwrite(to[1], buf, utf8encode(bp->u, buf)) < 0)
+			if (xwrite(to[1], buf, utf8encode(CELLRUNE(*bp), buf)) < 0)
 				break;
-		if ((newline = TLINE_HIST(n)[lastpos].mode & ATTR_WRAP))
+		if ((newline = !!(TLINE_HIST(n)->cell[lastpos] & CELL_WRAP)))
 			continue;
 		if (xwrite(to[1], "\n", 1) < 0)
 			break;
@@ -2146,9 +4156,119 @@ strdump(void)
 	fprintf(stderr, "ESC\\\n");
 }
 
+void
+strput(const char *s, size_t len)
+{
+	size_t n;
+	int sep;
+
+	if (strescseq.state == STR_IGNORE || strescseq.state == STR_LONG)
+		return;
+	if (len >= maxstrsiz - strescseq.total) {
+		free(strescseq.dec);
+		strescseq.dec = NULL;
+		strescseq.state = STR_LONG;
+		return;
+	}
+	strescseq.total += len;
+
+	if (strescseq.state == STR_SEL) {
+		strputsel(s, len);
+		return;
+	}
+
+	/* an OSC 52 payload goes to strputsel() instead of the buffer */
+	while (len > 0) {
+		n = len;
+		sep = 0;
+		if (strescseq.type == ']' && strescseq.narg < 2) {
+			for (n = 0; n < len && !sep; n++)
+				sep = s[n] == ';' && ++strescseq.narg == 2;
+		}
+
+		if (strescseq.len + n >= strescseq.siz) {
+			strescseq.siz = MIN(MAX(strescseq.siz * 2,
+			                    strescseq.len + n + 1), maxstrsiz);
+			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
+		}
+		memcpy(&strescseq.buf[strescseq.len], s, n);
+		strescseq.len += n;
+		s += n;
+		len -= n;
+
+		if (sep && atoi(strescseq.buf) == 52) {
+			if (!allowwindowops) {
+				strescseq.state = STR_IGNORE;
+				return;
+			}
+			strescseq.state = STR_SEL;
+			strescseq.decsiz = STR_BUF_SIZ;
+			strescseq.dec = xmalloc(strescseq.decsiz);
+			strputsel(s, len);
+			return;
+		}
+	}
+}
+
+/*
+ * Decodes base64 into strescseq.dec as it arrives. As before, digits out
+ * of the alphabet count as zero, unprintable characters are skipped and
+ * padding ends the payload.
+ */
+void
+strputsel(const char *s, size_t len)
+{
+	static size_t (*decode)(const char *, size_t, char *);
+	size_t i = 0, k, need;
+	char *d;
+	int c;
+
+	if (!decode) {
+		decode = base64decquads;
+#ifdef BASE64_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			decode = base64decavx2;
+#endif
+	}
+
+	if (strescseq.nquad < 0)
+		return;
+	/* room for the data, the terminator and the overshoot of decode() */
+	need = strescseq.declen + (len + 3) / 4 * 3 + 32;
+	if (need > strescseq.decsiz) {
+		strescseq.decsiz = MAX(strescseq.decsiz * 2, need);
+		strescseq.dec = xrealloc(strescseq.dec, strescseq.decsiz);
+	}
+
+	d = strescseq.dec + strescseq.declen;
+	while (i < len) {
+		/* whole quads in bulk, then one digit at a time */
+		if (strescseq.nquad == 0) {
+			k = decode(s + i, len - i, d);
+			i += k;
+			d += k / 4 * 3;
+			if (i == len)
+				break;
+		}
+		if (!isprint(c = (uchar)s[i++]))
+			continue;
+		strescseq.quad[strescseq.nquad++] = base64_digits[c];
+		if (strescseq.nquad < 4)
+			continue;
+		if (!base64quad(strescseq.quad, &d)) {
+			strescseq.nquad = -1;
+			break;
+		}
+		strescseq.nquad = 0;
+	}
+	strescseq.declen = d - strescseq.dec;
+}
+
 void
 strreset(void)
 {
+	free(strescseq.dec);
 	strescseq = (STREscape){
 		.buf = xrealloc(strescseq.buf, STR_BUF_SIZ),
 		.siz = STR_BUF_SIZ,
@@ -2163,7 +4283,7 @@ sendbreak(const Arg *arg)
 }
 
 void
-tprinter(char *s, size_t len)
+tprinter(const char *s, size_t len)
 {
 	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
 		perror("Error writing to output file");
@@ -2172,6 +4292,40 @@ tprinter(char *s, size_t len)
 	}
 }
 
+/*
+ * Logs a chunk read from the tty for -R: the microseconds since the last
+ * one and the length as LEB128 varints, then the bytes. Called with no
+ * data, it only starts the clock.
+ */
+void
+recwrite(const char *s, size_t len)
+{
+	static uint64_t last;
+	struct timespec now;
+	uint64_t v[2], t;
+	char hdr[20];
+	int i, n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	v[0] = t - last;
+	v[1] = len;
+	last = t;
+	if (!s)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		for (; v[i] > 0x7f; v[i] >>= 7)
+			hdr[n++] = (v[i] & 0x7f) | 0x80;
+		hdr[n++] = v[i];
+	}
+	if (xwrite(recfd, hdr, n) < 0 || xwrite(recfd, s, len) < 0) {
+		perror("Error writing to record file");
+		close(recfd);
+		recfd = -1;
+	}
+}
+
 void
 toggleprinter(const Arg *arg)
 {
@@ -2205,13 +4359,13 @@ void
 tdumpline(int n)
 {
 	char buf[UTF_SIZ];
-	const Glyph *bp, *end;
+	const Cell *bp, *end;
 
-	bp = &term.line[n][0];
+	bp = &term.line[n]->cell[0];
 	end = &bp[MIN(tlinelen(n), term.col) - 1];
-	if (bp != end || bp->u != ' ') {
+	if (bp != end || CELLRUNE(*bp) != ' ') {
 		for ( ; bp <= end; ++bp)
-			tprinter(buf, utf8encode(bp->u, buf));
+			tprinter(buf, utf8encode(CELLRUNE(*bp), buf));
 	}
 	tprinter("\n", 1);
 }
@@ -2297,6 +4451,9 @@ tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
+	/* DCS, APC and PM strings are not used, don't keep them */
+	if (c != ']' && c != 'k')
+		strescseq.state = STR_IGNORE;
 	term.esc |= ESC_STR;
 }
 
@@ -2490,7 +4647,8 @@ tputc(Rune u)
 	char c[UTF_SIZ];
 	int control;
 	int width, len;
-	Glyph *gp;
+	Cell *gp;
+	Line line;
 
 	control = ISCONTROL(u);
 	if (u < 127 || !IS_SET(MODE_UTF8)) {
@@ -2498,8 +4656,7 @@ tputc(Rune u)
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
+		width = runewidth(u);
 	}
 
 	if (IS_SET(MODE_PRINT))
@@ -2519,28 +4676,7 @@ tputc(Rune u)
 			goto check_control_code;
 		}
 
-		if (strescseq.len+len >= strescseq.siz) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
-			strescseq.siz *= 2;
-			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
-		}
-
-		memmove(&strescseq.buf[strescseq.len], c, len);
-		strescseq.len += len;
+		strput(c, len);
 		return;
 	}
 
@@ -2560,12 +4696,8 @@ check_control_code:
 		return;
 	} else if (term.esc & ESC_START) {
 		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
+			if (csiparse(u)) {
 				term.esc = 0;
-				csiparse();
 				csihandle();
 			}
 			return;
@@ -2590,33 +4722,40 @@ check_control_code:
 	if (selected(term.c.x, term.c.y))
 		selclear();
 
-	gp = &term.line[term.c.y][term.c.x];
+	line = term.line[term.c.y];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		line->cell[term.c.x] |= CELL_WRAP;
 		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+		line = term.line[term.c.y];
 	}
 
-	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col)
-		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
+	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
+		linemove(line, term.c.x+width, term.c.x,
+		         term.col - term.c.x - width);
+		tsetdirtx(term.c.y, term.c.x, term.col);
+	}
 
 	if (term.c.x+width > term.col) {
 		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+		line = term.line[term.c.y];
 	}
 
 	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
 	term.lastc = u;
 
 	if (width == 2) {
-		gp->mode |= ATTR_WIDE;
+		gp = &line->cell[term.c.x];
+		*gp |= CELL_WIDE;
 		if (term.c.x+1 < term.col) {
-			if (gp[1].mode == ATTR_WIDE && term.c.x+2 < term.col) {
-				gp[2].u = ' ';
-				gp[2].mode &= ~ATTR_WDUMMY;
-			}
-			gp[1].u = '\0';
-			gp[1].mode = ATTR_WDUMMY;
+			if ((gp[1] & CELL_WIDE) &&
+			    linemode(line, term.c.x+1) == ATTR_WIDE &&
+			    term.c.x+2 < term.col)
+				lineundummy(line, term.c.x+2);
+			/* the dummy takes the attributes of the wide char */
+			gp[1] = CELL('\0', ATTR_WDUMMY);
+			linesetattr(line, term.c.x+1, term.c.x+2,
+			            tattrid(&term.c.attr));
+			tsetdirtx(term.c.y, term.c.x+1, term.c.x+3);
 		}
 	}
 	if (term.c.x+width < term.col) {
@@ -2626,14 +4765,139 @@ check_control_code:
 	}
 }
 
+/* print a run of printable single width characters, as tputc() would */
+void
+tputrun(const Rune *u, int len)
+{
+	char c[BUFSIZ];
+	Cell *gp;
+	int i, n, x;
+
+	if (IS_SET(MODE_PRINT)) {
+		for (i = n = 0; i < len; i++) {
+			n += utf8encode(u[i], c + n);
+			if (n > sizeof(c) - UTF_SIZ || i == len - 1) {
+				tprinter(c, n);
+				n = 0;
+			}
+		}
+	}
+
+	while (len > 0) {
+		if (selected(term.c.x, term.c.y))
+			selclear();
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			term.line[term.c.y]->cell[term.c.x] |= CELL_WRAP;
+			tnewline(1);
+		}
+
+		x = term.c.x;
+		n = MIN(len, term.col - x);
+		if (sel.ob.x != -1) {
+			for (i = 1; i < n; i++) {
+				if (selected(x + i, term.c.y))
+					selclear();
+			}
+		}
+
+		gp = &term.line[term.c.y]->cell[x];
+		for (i = 0; i < n; i++) {
+			if (gp[i] & (CELL_WIDE|CELL_WDUMMY)) {
+				tsetchar(u[i], &term.c.attr, x + i, term.c.y);
+				continue;
+			}
+			gp[i] = CELL(u[i], term.c.attr.mode);
+			if (u[i] > 0x7f && isboxdraw(u[i]))
+				gp[i] |= CELL(0, ATTR_BOXDRAW);
+		}
+		linesetattr(term.line[term.c.y], x, x + n,
+		            tattrid(&term.c.attr));
+		tsetdirtx(term.c.y, x, x + n);
+		term.lastc = u[n - 1];
+		u += n;
+		len -= n;
+
+		tmoveto(x + n, term.c.y);
+		if (x + n == term.col)
+			term.c.state |= CURSOR_WRAPNEXT;
+	}
+}
+
+/* print decoded printable characters, single width ones in bulk */
+void
+tputrunes(const Rune *u, int len)
+{
+	int i;
+
+	while (len > 0) {
+		for (i = 0; i < len; i++) {
+			if (u[i] > 0x7f && runewidth(u[i]) != 1)
+				break;
+		}
+		if (i > 0) {
+			tputrun(u, i);
+		} else {
+			tputc(u[0]);
+			i = 1;
+		}
+		u += i;
+		len -= i;
+	}
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
+	Rune runes[BUFSIZ / 4];
+	size_t nrunes;
 	int charsize;
 	Rune u;
 	int n;
 
+	if (!show_ctrl)
+		syncdone = 0;
 	for (n = 0; n < buflen; n += charsize) {
+		/* CSI sequences are parsed without the tputc() round trip */
+		if ((term.esc & (ESC_START|ESC_CSI|ESC_STR)) ==
+		    (ESC_START|ESC_CSI) && BETWEEN(buf[n], ' ', '~') &&
+		    !IS_SET(MODE_PRINT)) {
+			charsize = 1;
+			if (csiparse(buf[n])) {
+				term.esc = 0;
+				csihandle();
+				/* stop for the frame of a synchronized update */
+				if (syncdone && !show_ctrl)
+					return n + 1;
+			}
+			continue;
+		}
+		/* so are the printable parts of string sequences */
+		if ((term.esc & ESC_STR) && BETWEEN(buf[n], ' ', '~') &&
+		    !IS_SET(MODE_PRINT)) {
+			for (charsize = 1; n + charsize < buflen &&
+			     BETWEEN(buf[n + charsize], ' ', '~'); charsize++)
+				;
+			strput(buf + n, charsize);
+			continue;
+		}
+		/* plain text outside of sequences is decoded and stored in bulk */
+		if (!ISCONTROLC0((uchar)buf[n]) &&
+		    !(term.esc & (ESC_START|ESC_STR)) &&
+		    !IS_SET(MODE_INSERT) &&
+		    term.trantbl[term.charset] != CS_GRAPHIC0) {
+			nrunes = LEN(runes);
+			if (IS_SET(MODE_UTF8)) {
+				charsize = utf8decoderun(buf + n, buflen - n,
+				                         runes, &nrunes);
+			} else {
+				charsize = utf8decodeascii(buf + n, buflen - n,
+				                           runes, nrunes, &nrunes);
+			}
+			if (charsize > 0) {
+				tputrunes(runes, nrunes);
+				continue;
+			}
+		}
 		if (IS_SET(MODE_UTF8)) {
 			/* process a complete utf8 char */
 			charsize = utf8decode(buf + n, &u, buflen - n);
@@ -2661,8 +4925,9 @@ twrite(const char *buf, int buflen, int show_ctrl)
 void
 tresize(int col, int row)
 {
-	int i, j;
+	int i;
 	int tmp;
+	uint a;
 	int minrow, mincol;
 	int *bp;
 	TCursor c;
@@ -2680,14 +4945,24 @@ tresize(int col, int row)
 		return;
 	}
 
+	a = tattrid(&term.c.attr);
+
+	/* move the screens to the start of their buffers */
+	if (term.row > 0) {
+		memmove(term.linebuf, term.line, term.row * sizeof(Line));
+		memmove(term.altbuf, term.alt, term.row * sizeof(Line));
+		term.line = term.linebuf;
+		term.alt = term.altbuf;
+	}
+
 	/*
 	 * slide screen to keep cursor where we expect it -
 	 * tscrollup would work here, but we can optimize to
 	 * memmove because we're freeing the earlier lines
 	 */
 	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+		linefree(term.line[i]);
+		linefree(term.alt[i]);
 	}
 	/* ensure that both src and dst are not NULL */
 	if (i > 0) {
@@ -2695,34 +4970,33 @@ tresize(int col, int row)
 		memmove(term.alt, term.alt + i, row * sizeof(Line));
 	}
 	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+		linefree(term.line[i]);
+		linefree(term.alt[i]);
 	}
 
 	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
+	term.line = term.linebuf =
+		xrealloc(term.linebuf, LINE_SLACK * row * sizeof(Line));
+	term.alt  = term.altbuf =
+		xrealloc(term.altbuf,  LINE_SLACK * row * sizeof(Line));
+	/* the lines must fit the slabs, see linealloc() */
+	if (col > term.slabcol)
+		slabpack(MAX(col, term.slabcol + term.slabcol / 2), minrow);
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	for (i = 0; i < row; i++)
+		term.dirty[i] = (Dirty){ 0, col };
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
-	for (i = 0; i < HISTSIZE; i++) {
-		term.hist[i] = xrealloc(term.hist[i], col * sizeof(Glyph));
-		for (j = mincol; j < col; j++) {
-			term.hist[i][j] = term.c.attr;
-			term.hist[i][j].u = ' ';
-		}
-	}
-
 	/* resize each row to new width, zero-pad if needed */
 	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
+		linewiden(term.line[i], col, a);
+		linewiden(term.alt[i],  col, a);
 	}
 
 	/* allocate any new rows */
 	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		term.line[i] = lineinit(linealloc(), col, a);
+		term.alt[i]  = lineinit(linealloc(), col, a);
 	}
 	if (col > term.maxcol) {
 		bp = term.tabs + term.maxcol;
@@ -2765,14 +5039,31 @@ resettitle(void)
 void
 drawregion(int x1, int y1, int x2, int y2)
 {
-	int y;
+	const Cell *cell;
+	int y, dx1, dx2;
 
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
+		dx1 = MAX(x1, term.dirty[y].x1);
+		dx2 = MIN(x2, term.dirty[y].x2);
+		if (dx1 >= dx2)
 			continue;
 
-		term.dirty[y] = 0;
-		xdrawline(TLINE(y), x1, y, x2);
+		term.dirty[y] = (Dirty){ 0, 0 };
+		/* the columns are those of the screen, not of the history */
+		if (term.scr) {
+			xdrawline(TLINE(y), x1, y, x2);
+			continue;
+		}
+		/*
+		 * Shaping may join the cells up to a blank into a ligature,
+		 * and a wide char takes the cell after it.
+		 */
+		cell = TLINE(y)->cell;
+		while (dx1 > x1 && CELLRUNE(cell[dx1-1]) != ' ')
+			dx1--;
+		while (dx2 < x2 && CELLRUNE(cell[dx2]) != ' ')
+			dx2++;
+		xdrawline(TLINE(y), dx1, y, dx2);
 	}
 }
 
@@ -2780,6 +5071,7 @@ void
 draw(void)
 {
 	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int i;
 
 	if (!xstartdraw())
 		return;
@@ -2787,19 +5079,20 @@ draw(void)
 	/* adjust cursor position */
 	LIMIT(term.ocx, 0, term.col-1);
 	LIMIT(term.ocy, 0, term.row-1);
-	if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
+	if (term.line[term.ocy]->cell[term.ocx] & CELL_WDUMMY)
 		term.ocx--;
-	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
+	if (term.line[term.c.y]->cell[cx] & CELL_WDUMMY)
 		cx--;
 
+	for (i = 0; i < term.nscroll; i++)
+		xscroll(term.scroll[i].top, term.scroll[i].bot, term.scroll[i].n);
+	term.nscroll = 0;
+
+	/* remove the old cursor */
+	tsetdirtx(term.ocy, term.ocx, term.ocx+1);
 	drawregion(0, 0, term.col, term.row);
 	if (term.scr == 0)
-		xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
-				term.ocx, term.ocy, term.line[term.ocy][term.ocx],
-				term.line[term.ocy], term.col);
-	/* xdrawcursor(cx, term.c.y, term.line[term.c.y][cx], */
-	/* 		term.ocx, term.ocy, term.line[term.ocy][term.ocx], */
-	/* 		term.line[term.ocy], term.col); */
+		xdrawcursor(cx, term.c.y, tglyph(term.line[term.c.y], cx));
 	term.ocx = cx;
 	term.ocy = term.c.y;
 	xfinishdraw();
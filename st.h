@@ -70,7 +70,8 @@ typedef struct {
 	uint32_t bg;      /* background  */
 } Glyph;
 
-typedef Glyph *Line;
+/* a line of cells, its attributes kept as runs, see st.c */
+typedef struct Line_ *Line;
 
 typedef union {
 	int i;
@@ -94,15 +95,25 @@ void printsel(const Arg *);
 void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
+int tattrrun(Line, int);
 int tattrset(int);
+Glyph tglyph(Line, int);
+void tglyphs(Line, int, int, Glyph *);
+int tinsync(unsigned int);
+int tsyncdone(void);
 void tnew(int, int);
+void tpackhist(void);
 void tresize(int, int);
 void tsetdirtattr(int);
+size_t ttyflush(void);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
+void ttyrecord(const char *);
+void ttyreplay(const char *, int);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
+int twrite(const char *, int, int);
 
 void resettitle(void);
 
@@ -111,6 +122,7 @@ void selinit(void);
 void selstart(int, int, int);
 void selextend(int, int, int, int);
 int selected(int, int);
+int selectedcols(int, int *, int *);
 char *getsel(void);
 
 size_t utf8encode(Rune, char *);
@@ -137,6 +149,11 @@ extern int allowaltscreen;
 extern int allowwindowops;
 extern char *termname;
 extern unsigned int tabspaces;
+extern unsigned int maxstrsiz;
+extern unsigned int histsize;
+extern unsigned int histcold;
+extern int histspill;
+extern unsigned int ambiguouswidth;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern float alpha;
@@ -0,0 +1,102 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * Settings of the terminal emulation. config.h includes this file, and
+ * st-bench is built with it too.
+ */
+
+/* the shell is run through utmp or scroll when set, see config.h */
+char *utmp = NULL;
+/* scroll program: to enable use a string like "scroll" */
+char *scroll = NULL;
+char *stty_args = "stty raw pass8 nl -echo -iexten -cstopb 38400";
+
+/* identification sequence returned in DA and DECID */
+char *vtiden = "\033[?6c";
+
+/*
+ * word delimiter string
+ *
+ * More advanced example: L" `'\"()[]{}"
+ */
+wchar_t *worddelimiters = L" ";
+
+/*
+ * maximum length of a string sequence (OSC, DCS, ...) in bytes. Longer
+ * ones are dropped instead of being buffered.
+ */
+unsigned int maxstrsiz = 16 << 20;
+
+/*
+ * lines of scrollback kept at most. The history takes memory as lines
+ * are scrolled into it, and gives it back on a reset or an ED 3.
+ */
+unsigned int histsize = 2000;
+
+/*
+ * history lines kept as they are. Older ones are compressed in blocks, a
+ * few after each frame, and unpacked again when they are scrolled back to,
+ * selected or piped.
+ */
+unsigned int histcold = 1000;
+
+/*
+ * 1 to keep the compressed history in an unlinked temporary file, mapped,
+ * instead of memory. For a histsize of millions of lines.
+ */
+int histspill = 0;
+
+/*
+ * width in columns of East Asian ambiguous characters (1 or 2). Set it to
+ * what the applications you run assume, usually by the locale.
+ */
+unsigned int ambiguouswidth = 1;
+
+/* alt screens */
+int allowaltscreen = 1;
+
+/* allow certain non-interactive (insecure) window operations such as:
+   setting the clipboard text */
+int allowwindowops = 0;
+
+/*
+ * 1: render most of the lines/blocks characters without using the font for
+ *    perfect alignment between cells (U2500 - U259F except dashes/diagonals).
+ *    Bold affects lines thickness if boxdraw_bold is not 0. Italic is ignored.
+ * 0: disable (render all U25XX glyphs normally from the font).
+ */
+const int boxdraw = 1;
+const int boxdraw_bold = 0;
+
+/* braille (U28XX):  1: render as adjacent "pixels",  0: use font */
+const int boxdraw_braille = 0;
+
+/* default TERM value */
+char *termname = "st-256color";
+
+/*
+ * spaces per tab
+ *
+ * When you are changing this value, don't forget to adapt the »it« value in
+ * the st.info and appropriately install the st.info in the environment where
+ * you use this st version.
+ *
+ *	it#$tabspaces,
+ *
+ * Secondly make sure your kernel is not expanding tabs. When running `stty
+ * -a` »tab0« should appear. You can tell the terminal to not expand tabs by
+ *  running following command:
+ *
+ *	stty tabs
+ */
+unsigned int tabspaces = 8;
+
+/*
+ * Default colors (colorname index)
+ * foreground, background, cursor, reverse cursor
+ */
+unsigned int defaultfg = 259;
+unsigned int defaultbg = 258;
+unsigned int defaultcs = 256;
+unsigned int defaultrcs = 257;
+unsigned int background = 258;
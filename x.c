@@ -5,6 +5,7 @@
 #include <locale.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -89,6 +90,19 @@ static void ttysend(const Arg *);
 #define TRUEGREEN(x)		(((x) & 0xff00))
 #define TRUEBLUE(x)		(((x) & 0xff) << 8)
 
+/* INCR pastes wait while more than this is queued for the tty */
+#define PASTE_BACKLOG		(64 * 1024)
+
+/* colors made while drawing are kept in COLOR_SETS sets of COLOR_WAYS */
+#define COLOR_SETS		64
+#define COLOR_WAYS		4
+
+/* areas drawn in a frame, merged into their bounds past this */
+#define DAMAGE_MAX		64
+
+/* colors of the fills batched in a frame, flushed early past this */
+#define FILL_COLORS		32
+
 typedef XftDraw *Draw;
 typedef XftColor Color;
 typedef XftGlyphFontSpec GlyphFontSpec;
@@ -108,7 +122,10 @@ typedef struct {
 	Colormap cmap;
 	Window win;
 	Drawable buf;
+	XRectangle damage[DAMAGE_MAX]; /* drawn in buf, not yet in win */
+	int ndamage;
 	GlyphFontSpec *specbuf; /* font spec buffer used for rendering */
+	Glyph *glyphbuf; /* the line being drawn, unpacked */
 	Atom xembed, wmdeletewin, netwmname, netwmiconname, netwmpid;
 	struct {
 		XIM xim;
@@ -129,6 +146,7 @@ typedef struct {
 typedef struct {
 	Atom xtarget;
 	char *primary, *clipboard;
+	Atom incrprop; /* INCR chunk to acknowledge once the tty catches up */
 	struct timespec tclick1;
 	struct timespec tclick2;
 } XSelection;
@@ -157,11 +175,55 @@ typedef struct {
 	GC gc;
 } DC;
 
+/* Glyph found for a rune in a font style, see xglyphslot() */
+typedef struct {
+	Rune u;
+	int flags;     /* FRC_* */
+	XftFont *font; /* NULL in free slots */
+	FT_UInt glyph;
+} GlyphCache;
+
+/* Color made while drawing, see xcolor() */
+typedef struct {
+	uint64_t rgba;
+	uint64_t used; /* when it was last used, 0 in free slots */
+	Color col;
+} ColorCache;
+
+/* rectangles of one color, filled at once by xflushdraw() */
+typedef struct {
+	XRenderColor color;
+	XRectangle *rects;
+	int len, cap;
+} FillBatch;
+
+/* glyphs drawn by xflushdraw(), clipped to their cells if they overflow */
+typedef struct {
+	Color fg, bg;
+	int spec, len; /* in frame.specs */
+	int x, y, w; /* the cells, in pixels */
+	int clip, boxdraw;
+} GlyphRun;
+
+/* what the lines of a frame draw, as backgrounds, glyphs, decorations */
+enum { FILL_BG, FILL_LINE };
+
 static inline ushort sixd_to_16bit(int);
+static Color *xcolor(const XRenderColor *);
+static GlyphCache *xglyphslot(Rune, int);
+static XftFont *xfindglyph(Font *, int, Rune, FT_UInt *);
+static time_t xfontconfigtime(void);
+static void xloadfallbacks(void);
+static XftFont *xopenfallback(Font *, int, Rune);
+static void xsavefallback(int, Rune, FcPattern *);
 static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Glyph *, int, int, int);
 static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, int, int, int);
 static void xdrawglyph(Glyph, int, int);
 static void xclear(int, int, int, int);
+static void xdamage(int, int, int, int);
+static void xfill(int, const Color *, int, int, int, int);
+static void xfillflush(int);
+static void xflushdraw(void);
 static int xgeommasktogravity(int);
 static int ximopen(Display *);
 static void ximinstantiate(Display *, XPointer, XPointer);
@@ -259,6 +321,41 @@ typedef struct {
 static Fontcache *frc = NULL;
 static int frclen = 0;
 static int frccap = 0;
+
+/*
+ * Fallback fonts fontconfig found for runes before, kept in fbpath, one
+ * file by font, for the next terminals as long as the fontconfig setup
+ * stays the same
+ */
+typedef struct {
+	Rune u;
+	int flags;
+	int index;
+	char *file;
+} Fallback;
+
+static Fallback *fb = NULL;
+static int fblen = 0;
+static int fbcap = 0;
+static char fbpath[PATH_MAX];
+static char fbhead[64];
+
+static ColorCache ccache[COLOR_SETS][COLOR_WAYS];
+static uint64_t ccacheused = 0;
+
+static struct {
+	FillBatch fill[2][FILL_COLORS];
+	int nfill[2];
+	GlyphRun *runs;
+	int nruns, runcap;
+	XftGlyphFontSpec *specs;
+	int nspecs, speccap;
+} frame;
+
+/* open addressed, gcachesiz is a power of two */
+static GlyphCache *gcache = NULL;
+static size_t gcachesiz = 0;
+static size_t gcachelen = 0;
 static char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
@@ -268,10 +365,14 @@ static char *opt_class = NULL;
 static char **opt_cmd  = NULL;
 static char *opt_embed = NULL;
 static char *opt_font  = NULL;
+static char *opt_hist  = NULL;
 static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
 static char *opt_title = NULL;
+static char *opt_record = NULL;
+static char *opt_replay = NULL;
+static int opt_fast = 0;
 
 static int focused = 0;
 
@@ -636,8 +737,13 @@ selnotify(XEvent *e)
 
 	/*
 	 * Deleting the property again tells the selection owner to send the
-	 * next data chunk in the property.
+	 * next data chunk in the property. During an INCR transfer run()
+	 * does that once the shell has taken most of the paste.
 	 */
+	if (e->type == PropertyNotify && ttyflush() > PASTE_BACKLOG) {
+		xsel.incrprop = property;
+		return;
+	}
 	XDeleteProperty(xw.dpy, xw.win, (int)property);
 }
 
@@ -787,6 +893,7 @@ xresize(int col, int row)
 	win.tw = col * win.cw;
 	win.th = row * win.ch;
 
+	xflushdraw();
 	XFreePixmap(xw.dpy, xw.buf);
 	xw.buf = XCreatePixmap(xw.dpy, xw.win, win.w, win.h,
 			xw.depth);
@@ -795,6 +902,7 @@ xresize(int col, int row)
 
 	/* resize to new width */
 	xw.specbuf = xrealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
+	xw.glyphbuf = xrealloc(xw.glyphbuf, col * sizeof(Glyph));
 }
 
 ushort
@@ -894,17 +1002,153 @@ xsetcolorname(int x, const char *name)
 	return 0;
 }
 
+/*
+ * The color of c, allocated the first time it is asked for. The least
+ * recently used one of its set is freed to make room.
+ */
+Color *
+xcolor(const XRenderColor *c)
+{
+	uint64_t rgba = (uint64_t)c->red << 48 | (uint64_t)c->green << 32 |
+	                (uint64_t)c->blue << 16 | c->alpha;
+	ColorCache *set, *e;
+	int i;
+
+	set = e = ccache[(rgba * 0x9e3779b97f4a7c15ULL >> 32) % COLOR_SETS];
+
+	for (i = 0; i < COLOR_WAYS; i++) {
+		if (set[i].used && set[i].rgba == rgba) {
+			set[i].used = ++ccacheused;
+			return &set[i].col;
+		}
+		if (set[i].used < e->used)
+			e = &set[i];
+	}
+	if (e->used)
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &e->col);
+	XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, c, &e->col);
+	e->rgba = rgba;
+	e->used = ++ccacheused;
+	return &e->col;
+}
+
 /*
  * Absolute coordinates.
  */
 void
 xclear(int x1, int y1, int x2, int y2)
 {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
+	xdamage(x1, y1, x2 - x1, y2 - y1);
+	xfill(FILL_BG, &dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
 			x1, y1, x2-x1, y2-y1);
 }
 
+/*
+ * Queue a rectangle of color c to the backgrounds or decorations of the
+ * frame. Fills of the same color go to the server as one request.
+ */
+void
+xfill(int set, const Color *c, int x, int y, int w, int h)
+{
+	FillBatch *b;
+	int i;
+
+	if (w <= 0 || h <= 0)
+		return;
+	for (i = frame.nfill[set] - 1; i >= 0; i--) {
+		b = &frame.fill[set][i];
+		if (!memcmp(&b->color, &c->color, sizeof(b->color)))
+			break;
+	}
+	if (i < 0) {
+		if (frame.nfill[set] == FILL_COLORS)
+			xflushdraw();
+		b = &frame.fill[set][frame.nfill[set]++];
+		b->color = c->color;
+		b->len = 0;
+	}
+	if (b->len == b->cap) {
+		b->cap = MAX(64, b->cap * 2);
+		b->rects = xrealloc(b->rects, b->cap * sizeof(*b->rects));
+	}
+	b->rects[b->len++] = (XRectangle){ x, y, w, h };
+}
+
+void
+xfillflush(int set)
+{
+	Picture pict;
+	FillBatch *b;
+	Color c;
+	int i, j;
+
+	if (frame.nfill[set] == 0)
+		return;
+	/* without Render, Xft draws the fills with the core protocol */
+	pict = XftDrawPicture(xw.draw);
+	for (i = 0; i < frame.nfill[set]; i++) {
+		b = &frame.fill[set][i];
+		if (pict) {
+			XRenderFillRectangles(xw.dpy, PictOpSrc, pict,
+					&b->color, b->rects, b->len);
+			continue;
+		}
+		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &b->color, &c);
+		for (j = 0; j < b->len; j++) {
+			XftDrawRect(xw.draw, &c, b->rects[j].x, b->rects[j].y,
+					b->rects[j].width, b->rects[j].height);
+		}
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &c);
+	}
+	frame.nfill[set] = 0;
+}
+
+/*
+ * Draw what the frame queued so far: all backgrounds, then the glyphs,
+ * then underlines and strikethroughs. Runs of glyphs within their cells
+ * are drawn together without setting a clip.
+ */
+void
+xflushdraw(void)
+{
+	GlyphRun *r;
+	XRectangle clip;
+	int i, j, len, clipped = 0;
+
+	xfillflush(FILL_BG);
+	for (i = 0; i < frame.nruns; i = j) {
+		r = &frame.runs[i];
+		len = r->len;
+		for (j = i + 1; j < frame.nruns && !r->clip && !r->boxdraw; j++) {
+			if (frame.runs[j].clip || frame.runs[j].boxdraw ||
+			    memcmp(&frame.runs[j].fg.color, &r->fg.color,
+			    sizeof(r->fg.color)))
+				break;
+			len += frame.runs[j].len;
+		}
+		if (clipped != r->clip) {
+			clipped = r->clip;
+			if (!clipped)
+				XftDrawSetClip(xw.draw, 0);
+		}
+		if (r->clip) {
+			clip = (XRectangle){ 0, 0, r->w, win.ch };
+			XftDrawSetClipRectangles(xw.draw, r->x, r->y, &clip, 1);
+		}
+		if (r->boxdraw) {
+			drawboxes(r->x, r->y, r->w / r->len, win.ch, &r->fg,
+					&r->bg, &frame.specs[r->spec], r->len);
+		} else {
+			XftDrawGlyphFontSpec(xw.draw, &r->fg,
+					&frame.specs[r->spec], len);
+		}
+	}
+	if (clipped)
+		XftDrawSetClip(xw.draw, 0);
+	frame.nruns = frame.nspecs = 0;
+	xfillflush(FILL_LINE);
+}
+
 void
 xhints(void)
 {
@@ -1212,6 +1456,9 @@ xunloadfonts(void)
 	/* Free the loaded fonts in the font cache.  */
 	while (frclen > 0)
 		XftFontClose(xw.dpy, frc[--frclen].font);
+	if (gcache)
+		memset(gcache, 0, gcachesiz * sizeof(*gcache));
+	gcachelen = 0;
 
 	xunloadfont(&dc.font);
 	xunloadfont(&dc.bfont);
@@ -1219,6 +1466,125 @@ xunloadfonts(void)
 	xunloadfont(&dc.ibfont);
 }
 
+/* newest change to the fontconfig setup, as far as it can be seen */
+time_t
+xfontconfigtime(void)
+{
+	FcStrList *list;
+	FcChar8 *path;
+	struct stat st;
+	time_t t = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		list = i ? FcConfigGetFontDirs(NULL) : FcConfigGetConfigFiles(NULL);
+		while ((path = FcStrListNext(list))) {
+			if (!stat((char *)path, &st))
+				t = MAX(t, st.st_mtime);
+		}
+		FcStrListDone(list);
+	}
+	return t;
+}
+
+void
+xloadfallbacks(void)
+{
+	char line[PATH_MAX + 64], *dir, *p;
+	uint h = 2166136261U;
+	Fallback e;
+	FILE *f;
+	int n;
+
+	if ((dir = getenv("XDG_CACHE_HOME")) && *dir) {
+		n = snprintf(fbpath, sizeof(fbpath), "%s/st", dir);
+	} else if ((dir = getenv("HOME"))) {
+		n = snprintf(fbpath, sizeof(fbpath), "%s/.cache", dir);
+		mkdir(fbpath, 0700);
+		n += snprintf(fbpath + n, sizeof(fbpath) - n, "/st");
+	} else {
+		return;
+	}
+	mkdir(fbpath, 0700);
+	for (p = usedfont; *p; p++)
+		h = (h ^ (uchar)*p) * 16777619U;
+	if (snprintf(fbpath + n, sizeof(fbpath) - n, "/fallback-%08x", h) >=
+	    sizeof(fbpath) - n) {
+		fbpath[0] = '\0';
+		return;
+	}
+	snprintf(fbhead, sizeof(fbhead), "st-fallback %lld\n",
+	         (long long)xfontconfigtime());
+
+	if ((f = fopen(fbpath, "r")) && fgets(line, sizeof(line), f) &&
+	    !strcmp(line, fbhead)) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%d %x %d %n", &e.flags, &e.u, &e.index,
+			           &n) != 3 || !line[n])
+				continue;
+			line[strcspn(line, "\n")] = '\0';
+			e.file = xstrdup(line + n);
+			if (fblen == fbcap) {
+				fbcap = MAX(2 * fbcap, 16);
+				fb = xrealloc(fb, fbcap * sizeof(*fb));
+			}
+			fb[fblen++] = e;
+		}
+		fclose(f);
+		return;
+	}
+	/* written for another fontconfig setup, start over */
+	if (f)
+		fclose(f);
+	if ((f = fopen(fbpath, "w"))) {
+		fputs(fbhead, f);
+		fclose(f);
+	}
+}
+
+/* the fallback font found for rune u in the style flags before, opened */
+XftFont *
+xopenfallback(Font *font, int flags, Rune u)
+{
+	FcPattern *pattern;
+	XftFont *xf;
+	int i;
+
+	for (i = 0; i < fblen && (fb[i].u != u || fb[i].flags != flags); i++)
+		;
+	if (i == fblen)
+		return NULL;
+
+	/* the font of the style, from another file */
+	pattern = FcPatternDuplicate(font->match->pattern);
+	FcPatternDel(pattern, FC_FILE);
+	FcPatternDel(pattern, FC_INDEX);
+	FcPatternDel(pattern, FC_CHARSET);
+	FcPatternAddString(pattern, FC_FILE, (FcChar8 *)fb[i].file);
+	FcPatternAddInteger(pattern, FC_INDEX, fb[i].index);
+	if (!(xf = XftFontOpenPattern(xw.dpy, pattern)))
+		FcPatternDestroy(pattern);
+	return xf;
+}
+
+void
+xsavefallback(int flags, Rune u, FcPattern *match)
+{
+	FcChar8 *file;
+	int index;
+	FILE *f;
+
+	if (!fbpath[0] || !match ||
+	    FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
+		return;
+	if (FcPatternGetInteger(match, FC_INDEX, 0, &index) != FcResultMatch)
+		index = 0;
+	if ((f = fopen(fbpath, "a"))) {
+		fprintf(f, "%d %x %d %s\n", flags, u, index, (char *)file);
+		fclose(f);
+	}
+}
+
 int
 ximopen(Display *dpy)
 {
@@ -1303,6 +1669,7 @@ xinit(int cols, int rows)
 
 	usedfont = (opt_font == NULL)? font : opt_font;
 	xloadfonts(usedfont, 0);
+	xloadfallbacks();
 
 	/* spare fonts */
 	xloadsparefonts();
@@ -1342,6 +1709,7 @@ xinit(int cols, int rows)
 
 	/* font spec buffer */
 	xw.specbuf = xmalloc(cols * sizeof(GlyphFontSpec));
+	xw.glyphbuf = xmalloc(cols * sizeof(Glyph));
 
 	/* Xft rendering context */
 	xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
@@ -1389,6 +1757,7 @@ xinit(int cols, int rows)
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick1);
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick2);
 	xsel.primary = NULL;
+	xsel.incrprop = None;
 	xsel.clipboard = NULL;
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
@@ -1397,6 +1766,126 @@ xinit(int cols, int rows)
 	boxdraw_xinit(xw.dpy, xw.cmap, xw.draw, xw.vis);
 }
 
+/*
+ * Slot of rune u in the font style flags in gcache, its font is NULL if
+ * the glyph is not cached yet
+ */
+GlyphCache *
+xglyphslot(Rune u, int flags)
+{
+	GlyphCache *old = gcache;
+	size_t i, n = gcachesiz;
+
+	if (4 * (gcachelen + 1) > 3 * gcachesiz) {
+		gcachesiz = MAX(2 * gcachesiz, 256);
+		gcache = xmalloc(gcachesiz * sizeof(*gcache));
+		memset(gcache, 0, gcachesiz * sizeof(*gcache));
+		for (i = 0; i < n; i++) {
+			if (old[i].font)
+				*xglyphslot(old[i].u, old[i].flags) = old[i];
+		}
+		free(old);
+	}
+	for (i = (u * 2654435761U ^ flags) & (gcachesiz - 1);
+	     gcache[i].font && (gcache[i].u != u || gcache[i].flags != flags);
+	     i = (i + 1) & (gcachesiz - 1))
+		;
+	return &gcache[i];
+}
+
+/* font with the glyph of rune u in the style of font, and its index */
+XftFont *
+xfindglyph(Font *font, int frcflags, Rune rune, FT_UInt *glyph)
+{
+	FT_UInt glyphidx = 0;
+	FcResult fcres;
+	FcPattern *fcpattern, *fontpattern;
+	FcFontSet *fcsets[] = { NULL };
+	FcCharSet *fccharset;
+	int f;
+
+	/* Lookup character index with default font. */
+	if ((*glyph = XftCharIndex(xw.dpy, font->match, rune)))
+		return font->match;
+
+	/* Fallback on font cache, search the font cache for match. */
+	for (f = 0; f < frclen; f++) {
+		glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
+		/* Everything correct. */
+		if (glyphidx && frc[f].flags == frcflags)
+			break;
+		/* We got a default font for a not found glyph. */
+		if (!glyphidx && frc[f].flags == frcflags
+				&& frc[f].unicodep == rune) {
+			break;
+		}
+	}
+
+	/* Allocate memory for the new cache entry. */
+	if (f >= frclen && frclen >= frccap) {
+		frccap += 16;
+		frc = xrealloc(frc, frccap * sizeof(Fontcache));
+	}
+
+	/* Try the font found for the rune in an earlier run. */
+	if (f >= frclen && (frc[f].font = xopenfallback(font, frcflags, rune))) {
+		frc[f].flags = frcflags;
+		frc[f].unicodep = rune;
+		frclen++;
+		glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
+	}
+
+	/* Nothing was found. Use fontconfig to find matching font. */
+	if (f >= frclen) {
+		if (!font->set)
+			font->set = FcFontSort(0, font->pattern,
+			                       1, 0, &fcres);
+		fcsets[0] = font->set;
+
+		/*
+		 * Nothing was found in the cache. Now use
+		 * some dozen of Fontconfig calls to get the
+		 * font for one single character.
+		 *
+		 * Xft and fontconfig are design failures.
+		 */
+		fcpattern = FcPatternDuplicate(font->pattern);
+		fccharset = FcCharSetCreate();
+
+		FcCharSetAddChar(fccharset, rune);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET,
+				fccharset);
+		FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+		FcConfigSubstitute(0, fcpattern,
+				FcMatchPattern);
+		FcDefaultSubstitute(fcpattern);
+
+		fontpattern = FcFontSetMatch(0, fcsets, 1,
+				fcpattern, &fcres);
+		xsavefallback(frcflags, rune, fontpattern);
+
+		frc[frclen].font = XftFontOpenPattern(xw.dpy,
+				fontpattern);
+		if (!frc[frclen].font)
+			die("XftFontOpenPattern failed seeking fallback font: %s\n",
+				strerror(errno));
+		frc[frclen].flags = frcflags;
+		frc[frclen].unicodep = rune;
+
+		glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
+
+		f = frclen;
+		frclen++;
+
+		FcPatternDestroy(fcpattern);
+		FcCharSetDestroy(fccharset);
+	}
+
+	*glyph = glyphidx;
+	return frc[f].font;
+}
+
 int
 xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x, int y)
 {
@@ -1406,12 +1895,9 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 	int frcflags = FRC_NORMAL;
 	float runewidth = win.cw;
 	Rune rune;
-	FT_UInt glyphidx;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
-	int i, f, numspecs = 0;
+	FT_UInt glyphidx = 0;
+	GlyphCache *gc;
+	int i, numspecs = 0;
 
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
 		/* Fetch rune and mode for current glyph. */
@@ -1441,89 +1927,23 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 			yp = winy + font->ascent;
 		}
 
-		if (mode & ATTR_BOXDRAW) {
-			/* minor shoehorning: boxdraw uses only this ushort */
-			glyphidx = boxdrawindex(&glyphs[i]);
-		} else {
-			/* Lookup character index with default font. */
-			glyphidx = XftCharIndex(xw.dpy, font->match, rune);
-		}
-		if (glyphidx) {
+		/* minor shoehorning: boxdraw uses only this ushort */
+		if ((mode & ATTR_BOXDRAW) &&
+		    (glyphidx = boxdrawindex(&glyphs[i]))) {
 			specs[numspecs].font = font->match;
-			specs[numspecs].glyph = glyphidx;
-			specs[numspecs].x = (short)xp;
-			specs[numspecs].y = (short)yp;
-			xp += runewidth;
-			numspecs++;
-			continue;
-		}
-
-		/* Fallback on font cache, search the font cache for match. */
-		for (f = 0; f < frclen; f++) {
-			glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
-			/* Everything correct. */
-			if (glyphidx && frc[f].flags == frcflags)
-				break;
-			/* We got a default font for a not found glyph. */
-			if (!glyphidx && frc[f].flags == frcflags
-					&& frc[f].unicodep == rune) {
-				break;
-			}
-		}
-
-		/* Nothing was found. Use fontconfig to find matching font. */
-		if (f >= frclen) {
-			if (!font->set)
-				font->set = FcFontSort(0, font->pattern,
-				                       1, 0, &fcres);
-			fcsets[0] = font->set;
-
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 *
-			 * Xft and fontconfig are design failures.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
-
-			FcCharSetAddChar(fccharset, rune);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-
-			fontpattern = FcFontSetMatch(0, fcsets, 1,
-					fcpattern, &fcres);
-
-			/* Allocate memory for the new cache entry. */
-			if (frclen >= frccap) {
-				frccap += 16;
-				frc = xrealloc(frc, frccap * sizeof(Fontcache));
+		} else {
+			/* Look the glyph up once per rune and style. */
+			gc = xglyphslot(rune, frcflags);
+			if (!gc->font) {
+				gc->font = xfindglyph(font, frcflags, rune,
+				                      &gc->glyph);
+				gc->u = rune;
+				gc->flags = frcflags;
+				gcachelen++;
 			}
-
-			frc[frclen].font = XftFontOpenPattern(xw.dpy,
-					fontpattern);
-			if (!frc[frclen].font)
-				die("XftFontOpenPattern failed seeking fallback font: %s\n",
-					strerror(errno));
-			frc[frclen].flags = frcflags;
-			frc[frclen].unicodep = rune;
-
-			glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
-
-			f = frclen;
-			frclen++;
-
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
+			specs[numspecs].font = gc->font;
+			glyphidx = gc->glyph;
 		}
-
-		specs[numspecs].font = frc[f].font;
 		specs[numspecs].glyph = glyphidx;
 		specs[numspecs].x = (short)xp;
 		specs[numspecs].y = (short)yp;
@@ -1543,9 +1963,11 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 	int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
 	int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch,
 	    width = charlen * win.cw;
-	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
+	Color *fg, *bg, *temp;
 	XRenderColor colfg, colbg;
-	XRectangle r;
+	XGlyphInfo ext;
+	GlyphRun *r;
+	int i, gx, gy;
 
 	/* Fallback on color display for attributes not supported by the font */
 	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
@@ -1561,8 +1983,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		colfg.red = TRUERED(base.fg);
 		colfg.green = TRUEGREEN(base.fg);
 		colfg.blue = TRUEBLUE(base.fg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
-		fg = &truefg;
+		fg = xcolor(&colfg);
 	} else {
 		fg = &dc.col[base.fg];
 	}
@@ -1572,8 +1993,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		colbg.green = TRUEGREEN(base.bg);
 		colbg.red = TRUERED(base.bg);
 		colbg.blue = TRUEBLUE(base.bg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
-		bg = &truebg;
+		bg = xcolor(&colbg);
 	} else {
 		bg = &dc.col[base.bg];
 	}
@@ -1590,9 +2010,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 			colfg.green = ~fg->color.green;
 			colfg.blue = ~fg->color.blue;
 			colfg.alpha = fg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg,
-					&revfg);
-			fg = &revfg;
+			fg = xcolor(&colfg);
 		}
 
 		if (bg == &dc.col[defaultbg]) {
@@ -1602,9 +2020,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 			colbg.green = ~bg->color.green;
 			colbg.blue = ~bg->color.blue;
 			colbg.alpha = bg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg,
-					&revbg);
-			bg = &revbg;
+			bg = xcolor(&colbg);
 		}
 	}
 
@@ -1613,8 +2029,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		colfg.green = fg->color.green / 2;
 		colfg.blue = fg->color.blue / 2;
 		colfg.alpha = fg->color.alpha;
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-		fg = &revfg;
+		fg = xcolor(&colfg);
 	}
 
 	if (base.mode & ATTR_REVERSE) {
@@ -1645,34 +2060,46 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		xclear(winx, winy + win.ch, winx + width, win.h);
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, win.ch);
-
-	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = win.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
-
-	if (base.mode & ATTR_BOXDRAW) {
-		drawboxes(winx, winy, width / len, win.ch, fg, bg, specs, len);
-	} else {
-		/* Render the glyphs. */
-		XftDrawGlyphFontSpec(xw.draw, fg, specs, len);
+	xdamage(winx, winy, width, win.ch);
+	xfill(FILL_BG, bg, winx, winy, width, win.ch);
+
+	/* Queue the glyphs, clipped if Xft would draw out of the cells. */
+	if (frame.runs == NULL || frame.nruns == frame.runcap) {
+		frame.runcap = MAX(256, frame.runcap * 2);
+		frame.runs = xrealloc(frame.runs,
+				frame.runcap * sizeof(*frame.runs));
+	}
+	if (frame.nspecs + len > frame.speccap) {
+		frame.speccap = MAX(frame.nspecs + len, frame.speccap * 2);
+		frame.specs = xrealloc(frame.specs,
+				frame.speccap * sizeof(*frame.specs));
+	}
+	r = &frame.runs[frame.nruns++];
+	*r = (GlyphRun){
+		.fg = *fg, .bg = *bg, .spec = frame.nspecs, .len = len,
+		.x = winx, .y = winy, .w = width,
+		.boxdraw = (base.mode & ATTR_BOXDRAW) != 0,
+	};
+	memcpy(&frame.specs[frame.nspecs], specs, len * sizeof(*specs));
+	frame.nspecs += len;
+	r->clip = (base.mode & ATTR_ITALIC) && !r->boxdraw;
+	for (i = 0; i < len && !r->clip && !r->boxdraw; i++) {
+		/* the ink of the glyph, x and y are its origin in it */
+		XftGlyphExtents(xw.dpy, specs[i].font, &specs[i].glyph, 1, &ext);
+		gx = specs[i].x - ext.x;
+		gy = specs[i].y - ext.y;
+		r->clip = gx < winx || gx + ext.width > winx + width ||
+		          gy < winy || gy + ext.height > winy + win.ch;
 	}
 
 	/* Render underline and strikethrough. */
-	if (base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + dc.font.ascent + 1, width, 1);
-	}
+	if (base.mode & ATTR_UNDERLINE)
+		xfill(FILL_LINE, fg, winx, winy + dc.font.ascent + 1, width, 1);
 
 	if (base.mode & ATTR_STRUCK) {
-		XftDrawRect(xw.draw, fg, winx, winy + 2 * dc.font.ascent * chscale / 3,
+		xfill(FILL_LINE, fg, winx, winy + 2 * dc.font.ascent * chscale / 3,
 				width, 1);
 	}
-
-	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
 }
 
 void
@@ -1686,18 +2113,10 @@ xdrawglyph(Glyph g, int x, int y)
 }
 
 void
-xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int len)
+xdrawcursor(int cx, int cy, Glyph g)
 {
 	Color drawcol;
 
-	/* remove the old cursor */
-	if (selected(ox, oy))
-		og.mode ^= ATTR_REVERSE;
-
-	/* Redraw the line where cursor was previously.
-	 * It will restore the ligatures broken by the cursor. */
-	xdrawline(line, 0, oy, len);
-
 	if (IS_SET(MODE_HIDE))
 		return;
 
@@ -1727,7 +2146,9 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 		drawcol = dc.col[g.bg];
 	}
 
-	/* draw the new one */
+	/* draw the new one, over what the lines queued */
+	xflushdraw();
+	xdamage(borderpx + cx * win.cw, borderpx + cy * win.ch, win.cw, win.ch);
 	if (IS_SET(MODE_FOCUSED)) {
 		switch (win.cursor) {
 		case 7: /* st extension */
@@ -1820,24 +2241,40 @@ xstartdraw(void)
 void
 xdrawline(Line line, int x1, int y1, int x2)
 {
-	int i, x, ox, numspecs;
+	int i, x, ox, end, sx1, sx2, sel = 0, span = 0, numspecs;
 	Glyph base, new;
 	XftGlyphFontSpec *specs = xw.specbuf;
 
-	numspecs = xmakeglyphfontspecs(specs, &line[x1], x2 - x1, x1, y1);
+	tglyphs(line, x1, x2, xw.glyphbuf);
+	numspecs = xmakeglyphfontspecs(specs, xw.glyphbuf, x2 - x1, x1, y1);
+	if (!selectedcols(y1, &sx1, &sx2))
+		sx1 = sx2 = -1;
 	i = ox = 0;
-	for (x = x1; x < x2 && i < numspecs; x++) {
-		new = line[x];
-		if (new.mode == ATTR_WDUMMY)
+	for (x = end = x1; x < x2 && i < numspecs; x++) {
+		/* the attributes change at runs and selection edges only */
+		if (x == end) {
+			end = MIN(tattrrun(line, x), x2);
+			if (x < sx1 && sx1 < end)
+				end = sx1;
+			else if (x <= sx2 && sx2 < end - 1)
+				end = sx2 + 1;
+			sel = BETWEEN(x, sx1, sx2);
+			span = 1;
+		}
+		new = xw.glyphbuf[x - x1];
+		if (new.mode & ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
+		if (sel)
 			new.mode ^= ATTR_REVERSE;
-		if (i > 0 && ATTRCMP(base, new)) {
+		/* within a span only the cells' own attributes differ */
+		if (i > 0 && (span ? ATTRCMP(base, new) :
+		    (base.mode ^ new.mode) & (ATTR_WIDE|ATTR_BOXDRAW))) {
 			xdrawglyphfontspecs(specs, base, i, ox, y1);
 			specs += i;
 			numspecs -= i;
 			i = 0;
 		}
+		span = 0;
 		if (i == 0) {
 			ox = x;
 			base = new;
@@ -1848,16 +2285,81 @@ xdrawline(Line line, int x1, int y1, int x2)
 		xdrawglyphfontspecs(specs, base, i, ox, y1);
 }
 
+/*
+ * Note the area x, y, w, h of xw.buf as drawn, for xfinishdraw(). The
+ * runs of a line and then the lines drawn whole are merged as they come.
+ */
+void
+xdamage(int x, int y, int w, int h)
+{
+	XRectangle *r;
+	int i, x2, y2;
+
+	if (w <= 0 || h <= 0)
+		return;
+	r = xw.ndamage > 0 ? &xw.damage[xw.ndamage - 1] : NULL;
+	if (r && r->y == y && r->height == h &&
+	    x <= r->x + r->width && r->x <= x + w) {
+		x2 = MAX(r->x + r->width, x + w);
+		r->x = MIN(r->x, x);
+		r->width = x2 - r->x;
+	} else {
+		if (xw.ndamage == DAMAGE_MAX) {
+			x2 = x + w;
+			y2 = y + h;
+			for (i = 0; i < xw.ndamage; i++) {
+				r = &xw.damage[i];
+				x = MIN(x, r->x);
+				y = MIN(y, r->y);
+				x2 = MAX(x2, r->x + r->width);
+				y2 = MAX(y2, r->y + r->height);
+			}
+			w = x2 - x;
+			h = y2 - y;
+			xw.ndamage = 0;
+		}
+		r = &xw.damage[xw.ndamage++];
+		*r = (XRectangle){ x, y, w, h };
+	}
+	for (; xw.ndamage > 1 && r[-1].x == r->x && r[-1].width == r->width &&
+	     r[-1].y + r[-1].height == r->y; r--, xw.ndamage--)
+		r[-1].height += r->height;
+}
+
 void
 xfinishdraw(void)
 {
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w,
-			win.h, 0, 0);
+	XRectangle *r;
+	int i;
+
+	xflushdraw();
+	/* show what was drawn, not the whole window */
+	for (i = 0; i < xw.ndamage; i++) {
+		r = &xw.damage[i];
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, r->x, r->y,
+		          r->width, r->height, r->x, r->y);
+	}
+	xw.ndamage = 0;
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
 }
 
+/* move what is drawn of lines top to bot up by n, down if n is negative */
+void
+xscroll(int top, int bot, int n)
+{
+	int h = bot - top + 1 - abs(n);
+
+	xflushdraw();
+	XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
+	          0, borderpx + (n > 0 ? top + n : top) * win.ch,
+	          win.w, h * win.ch,
+	          0, borderpx + (n > 0 ? top : top - n) * win.ch);
+	xdamage(0, borderpx + (n > 0 ? top : top - n) * win.ch,
+	        win.w, h * win.ch);
+}
+
 void
 xximspot(int x, int y)
 {
@@ -1870,10 +2372,15 @@ xximspot(int x, int y)
 	XSetICValues(xw.ime.xic, XNPreeditAttributes, xw.ime.spotlist, NULL);
 }
 
+/* xw.buf holds the window, the exposed area is only shown again */
 void
 expose(XEvent *ev)
 {
-	redraw();
+	XExposeEvent *e = &ev->xexpose;
+
+	xdamage(e->x, e->y, e->width, e->height);
+	if (e->count == 0)
+		draw();
 }
 
 void
@@ -2118,8 +2625,9 @@ run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
+	fd_set rfd, wfd;
+	int xfd = XConnectionNumber(xw.dpy), ttyfd, ttyin, xev, drawing, held;
+	size_t pending;
 	struct timespec seltv, *tv, now, lastblink, trigger;
 	double timeout;
 
@@ -2139,29 +2647,44 @@ run(void)
 		}
 	} while (ev.type != MapNotify);
 
+	if (opt_record)
+		ttyrecord(opt_record);
+	if (opt_replay)
+		ttyreplay(opt_replay, opt_fast);
 	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
 	cresize(w, h);
 
 	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
 		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
 		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
 
+		/* write what the tty takes, wait for it to take the rest */
+		if ((pending = ttyflush()) > 0)
+			FD_SET(ttyfd, &wfd);
+		if (xsel.incrprop != None && pending <= PASTE_BACKLOG) {
+			XDeleteProperty(xw.dpy, xw.win, xsel.incrprop);
+			xsel.incrprop = None;
+		}
+
 		if (XPending(xw.dpy))
 			timeout = 0;  /* existing events might not set xfd */
+		if (tsyncdone())
+			timeout = 0;  /* output after a drawn update is read */
 
 		seltv.tv_sec = timeout / 1E3;
 		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
 		tv = timeout >= 0 ? &seltv : NULL;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if (pselect(MAX(xfd, ttyfd)+1, &rfd, &wfd, NULL, tv, NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
 		}
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		if (FD_ISSET(ttyfd, &rfd))
+		if ((ttyin = FD_ISSET(ttyfd, &rfd) || tsyncdone()))
 			ttyread();
 
 		xev = 0;
@@ -2174,6 +2697,20 @@ run(void)
 				(handler[ev.type])(&ev);
 		}
 
+		/*
+		 * Only the tty taking more output: nothing new to draw, but
+		 * wait no longer than the next blink.
+		 */
+		if (FD_ISSET(ttyfd, &wfd) && !ttyin && !xev && !drawing) {
+			if (!blinktimeout || !tattrset(ATTR_BLINK)) {
+				timeout = -1;
+				continue;
+			}
+			timeout = blinktimeout - TIMEDIFF(now, lastblink);
+			if (timeout > 0)
+				continue;
+		}
+
 		/*
 		 * To reduce flicker and tearing, when new content or event
 		 * triggers drawing, we first wait a bit to ensure we got
@@ -2185,17 +2722,28 @@ run(void)
 		 * maximum latency intervals during `cat huge.txt`, and perfect
 		 * sync with periodic updates from animations/key-repeats/etc.
 		 */
-		if (FD_ISSET(ttyfd, &rfd) || xev) {
+		if (ttyin || xev) {
 			if (!drawing) {
 				trigger = now;
 				drawing = 1;
 			}
 			timeout = (maxlatency - TIMEDIFF(now, trigger)) \
 			          / maxlatency * minlatency;
-			if (timeout > 0)
+			/* a finished synchronized update needs no idle */
+			if (timeout > 0 && !tsyncdone())
 				continue;  /* we have time, try to find idle */
 		}
 
+		/*
+		 * While an application updates the screen synchronously,
+		 * draw nothing until it is done or synctimeout runs out.
+		 * drawing stays set to draw as soon as it is over.
+		 */
+		if ((held = tinsync(synctimeout)) > 0) {
+			timeout = held;
+			continue;
+		}
+
 		/* idle detected or maxlatency exhausted -> draw */
 		timeout = -1;
 		if (blinktimeout && tattrset(ATTR_BLINK)) {
@@ -2213,6 +2761,8 @@ run(void)
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;
+		/* compress a few history blocks a frame */
+		tpackhist();
 	}
 }
 
@@ -2271,13 +2821,17 @@ void
 usage(void)
 {
 	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
-	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
+	    " [-H lines] [-n name] [-o file]\n"
+	    "          [-R file] [-T title] [-t title] [-w windowid]"
 	    " [[-e] command [args ...]]\n"
 	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
-	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+	    " [-H lines] [-n name] [-o file]\n"
+	    "          [-R file] [-T title] [-t title] [-w windowid] -l line"
+	    " [stty_args ...]\n"
+	    "       %s [-aiFv] [-c class] [-f font] [-g geometry]"
+	    " [-H lines] [-n name] [-o file]\n"
+	    "          [-T title] [-t title] [-w windowid] -P file\n",
+	    argv0, argv0, argv0);
 }
 
 int
@@ -2304,10 +2858,16 @@ main(int argc, char *argv[])
 	case 'f':
 		opt_font = EARGF(usage());
 		break;
+	case 'F':
+		opt_fast = 1;
+		break;
 	case 'g':
 		xw.gm = XParseGeometry(EARGF(usage()),
 				&xw.l, &xw.t, &cols, &rows);
 		break;
+	case 'H':
+		opt_hist = EARGF(usage());
+		break;
 	case 'i':
 		xw.isfixed = 1;
 		break;
@@ -2320,6 +2880,12 @@ main(int argc, char *argv[])
 	case 'n':
 		opt_name = EARGF(usage());
 		break;
+	case 'P':
+		opt_replay = EARGF(usage());
+		break;
+	case 'R':
+		opt_record = EARGF(usage());
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());
@@ -2337,6 +2903,8 @@ main(int argc, char *argv[])
 run:
 	if (argc > 0) /* eat all remaining arguments */
 		opt_cmd = argv;
+	if (opt_replay && (opt_line || opt_cmd))
+		usage();
 
 	if (!opt_title)
 		opt_title = (opt_line || !opt_cmd) ? "st" : opt_cmd[0];
@@ -2348,6 +2916,8 @@ run:
 		die("Can't open display\n");
 
 	config_init();
+	if (opt_hist)
+		histsize = strtoul(opt_hist, NULL, 10);
 	cols = MAX(cols, 1);
 	rows = MAX(rows, 1);
 	defaultbg = MAX(LEN(colorname), 256);